@@ -17,7 +17,14 @@
 #if HAVE_SYS_PARAM_H
 #include <sys/param.h>
 #endif
+#include <sys/stat.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <pwd.h>
@@ -27,6 +34,7 @@
 #include <signal.h>
 #include <time.h>
 #include <errno.h>
+#include <poll.h>
 #include <maillock.h>
 #include <lockfile.h>
 
@@ -34,6 +42,10 @@
 #include <getopt.h>
 #endif
 
+#if defined(__linux__) && defined(SYS_pidfd_open)
+#define USE_PIDFD 1
+#endif
+
 #ifndef HAVE_GETOPT_H
 extern int getopt();
 extern char *optarg;
@@ -41,20 +53,19 @@ extern int optind;
 #endif
 
 extern int is_maillock(const char *lockfile);
-extern int lockfile_create_set_tmplock(const char *lockfile,
-			volatile char **tmplock, int retries, int flags, struct __lockargs *);
+extern int tmp_sweep(const char *dir, const char *lockfile,
+		int scan, long *cookie);
 
-static volatile char *tmplock;
+static struct lockfile_handle lh;
 static int quiet;
 
 /*
  *	If we got SIGINT, SIGQUIT, SIGHUP, remove the
- *	tempfile and re-raise the signal.
+ *	tempfile (and the lock, if we hold it) and re-raise the signal.
  */
 void got_signal(int sig)
 {
-	if (tmplock && tmplock[0])
-		unlink((char *)tmplock);
+	lockfile_handle_sigrelease(&lh);
 	signal(sig, SIG_DFL);
 	raise(sig);
 }
@@ -63,6 +74,18 @@ void ignore_signal(int sig)
 {
 }
 
+/*
+ *	Pass a signal on to the command, when we wait for it without
+ *	a signalfd.
+ */
+static volatile pid_t	forward_pid;
+
+void forward_signal(int sig)
+{
+	if (forward_pid > 0)
+		kill(forward_pid, sig);
+}
+
 /*
  *	Install signal handler only if the signal was
  *	not ignored already.
@@ -81,22 +104,22 @@ int set_signal(int sig, void (*handler)(int))
 }
 
 /*
- *	Sleep for an amount of time while regulary checking if
- *	our parent is still alive.
+ *	Sleep for an amount of time (in milliseconds) while
+ *	regulary checking if our parent is still alive.
  */
 int check_sleep(int sleeptime, int flags)
 {
 	int		i;
-	int		interval = 5;
+	int		interval = 5000;
 	static int	ppid = 0;
 
 	if (ppid == 0) ppid = getppid();
 
 	if (flags & __L_INTERVAL)
-		interval = 1;
+		interval = 1000;
 
 	for (i = 0; i < sleeptime; i += interval) {
-		sleep(interval);
+		poll(NULL, 0, sleeptime - i < interval ? sleeptime - i : interval);
 		if (kill(ppid, 0) < 0 && errno == ESRCH)
 			return L_ERROR;
 	}
@@ -163,27 +186,197 @@ void perror_exit(const char *why) {
 	exit(L_ERROR);
 }
 
+/*
+ *	Touch the lockfile, by fd if we have one.
+ */
+static void touch_lock(int touchfd)
+{
+	if (touchfd >= 0)
+		(void)futimens(touchfd, NULL);
+	else
+		(void)lockfile_handle_touch(&lh);
+}
+
+/*
+ *	Wait for the command to exit, touching the lockfile every
+ *	"refresh" seconds if that's > 0. Signals in "sigs" are blocked;
+ *	SIGTERM is passed on to the command, the others are ignored (the
+ *	command gets them from the terminal anyway). Returns the wait status.
+ *	The command doesn't have to be our child (exec mode), but then
+ *	there is no status.
+ */
+static int supervise(pid_t pid, int touchfd, int refresh,
+		sigset_t *sigs, sigset_t *oldsigs)
+{
+	int			e, wstatus = 0;
+#ifdef USE_PIDFD
+	struct pollfd		pfd[3];
+	struct itimerspec	its;
+	struct signalfd_siginfo	si;
+	uint64_t		ticks;
+	int			i;
+
+	pfd[0].fd = syscall(SYS_pidfd_open, pid, 0);
+	if (pfd[0].fd >= 0) {
+		pfd[1].fd = signalfd(-1, sigs, SFD_CLOEXEC);
+		pfd[2].fd = -1;
+		if (refresh > 0 &&
+		    (pfd[2].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) >= 0) {
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = refresh;
+			its.it_interval.tv_sec = refresh;
+			timerfd_settime(pfd[2].fd, 0, &its, NULL);
+		}
+		for (i = 0; i < 3; i++)
+			pfd[i].events = POLLIN;
+		while (1) {
+			if (poll(pfd, 3, -1) < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			if (pfd[0].revents)
+				break;
+			if ((pfd[1].revents & POLLIN) &&
+			    read(pfd[1].fd, &si, sizeof(si)) == sizeof(si) &&
+			    si.ssi_signo == SIGTERM)
+				kill(pid, SIGTERM);
+			if ((pfd[2].revents & POLLIN) &&
+			    read(pfd[2].fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+				touch_lock(touchfd);
+		}
+		for (i = 0; i < 3; i++)
+			if (pfd[i].fd >= 0)
+				close(pfd[i].fd);
+		while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+			;
+		return wstatus;
+	}
+#endif
+
+	/* No pidfd: wait in waitpid(), woken up by alarm(). */
+	if (sigismember(sigs, SIGTERM)) {
+		forward_pid = pid;
+		set_signal(SIGTERM, forward_signal);
+	}
+	sigprocmask(SIG_SETMASK, oldsigs, NULL);
+	while (1) {
+		if (refresh > 0)
+			alarm(refresh);
+		e = waitpid(pid, &wstatus, 0);
+		if (e < 0 && errno == ECHILD && refresh > 0) {
+			/* not our child: see if it's still there */
+			alarm(0);
+			while (1) {
+				sleep(refresh);
+				if (kill(pid, 0) < 0 && errno == ESRCH)
+					break;
+				touch_lock(touchfd);
+			}
+			break;
+		}
+		if (e >= 0 || errno != EINTR)
+			break;
+		if (refresh > 0)
+			touch_lock(touchfd);
+	}
+	alarm(0);
+	forward_pid = 0;
+	return wstatus;
+}
+
+/*
+ *	Exec mode without a holder fd (NFS): leave a process behind that
+ *	touches the lockfile until the command, which is going to be us,
+ *	exits, and then removes it if it is still the same file. It is
+ *	forked twice, so the command doesn't get a child it doesn't know
+ *	about.
+ */
+static void exec_supervisor(int touchfd, int refresh)
+{
+	struct stat	st, st2;
+	sigset_t	sigs;
+	pid_t		pid = getpid(), child;
+	int		fd;
+
+	if ((child = fork()) != 0) {
+		while (child > 0 && waitpid(child, NULL, 0) < 0 &&
+		       errno == EINTR)
+			;
+		return;
+	}
+	if (fork() != 0)
+		_exit(0);
+
+	/* the lock belongs to the command */
+	lh.locked = 0;
+	set_signal(SIGINT, ignore_signal);
+	set_signal(SIGQUIT, ignore_signal);
+	set_signal(SIGHUP, ignore_signal);
+	set_signal(SIGALRM, ignore_signal);
+	sigemptyset(&sigs);
+	(void)supervise(pid, touchfd, refresh, &sigs, &sigs);
+
+	/* not if the command removed it, and someone else has it now */
+	if (fstat(touchfd, &st) == 0 &&
+	    (fd = open(lh.lockfile, O_RDONLY|O_CLOEXEC)) >= 0) {
+		if (fstat(fd, &st2) == 0 &&
+		    st.st_dev == st2.st_dev && st.st_ino == st2.st_ino)
+			(void)unlink(lh.lockfile);
+		close(fd);
+	}
+	_exit(0);
+}
+
+/*
+ *	Drop privileges, go back to where we started, and run the
+ *	command. Only returns if that failed.
+ */
+static void run_command(char **cmd, gid_t gid, gid_t egid, int cwd_fd)
+{
+	/* drop setgid */
+	if (gid != egid && setgid(gid) < 0) {
+		perror("setgid");
+		return;
+	}
+	/* restore current working directory */
+	if (cwd_fd >= 0) {
+		if (fchdir(cwd_fd) < 0) {
+			perror("dotlockfile: restoring cwd:");
+			return;
+		}
+		close(cwd_fd);
+	}
+	/* exec */
+	execvp(cmd[0], cmd);
+	perror(cmd[0]);
+}
+
 /*
  *	Print usage mesage and exit.
  */
 void usage(void)
 {
-	fprintf(stderr, "Usage:  dotlockfile -l [-r retries] [-i interval] [-p] [-q] <-m|lockfile>\n");
-	fprintf(stderr, "        dotlockfile -l [-r retries] [-i interval] [-p] [-q] <-m|lockfile> [-P] command args...\n");
+	fprintf(stderr, "Usage:  dotlockfile -l [-r retries] [-i interval] [--timeout ms] [-p] [-q] <-m|lockfile>\n");
+	fprintf(stderr, "        dotlockfile -l [-r retries] [-i interval] [--timeout ms] [-p] [-q] <-m|lockfile> [-P] [-R secs] command args...\n");
+	fprintf(stderr, "        dotlockfile -l [-r retries] [-i interval] [--timeout ms] [-p] [-q] <-m|lockfile> -E command args...\n");
+	fprintf(stderr, "        dotlockfile -l -S [-r retries] [-i interval] [--timeout ms] [-q] <-m|name> [-E] command args...\n");
 	fprintf(stderr, "        dotlockfile -u|-t\n");
+	fprintf(stderr, "        dotlockfile -g [-q] directory\n");
 	exit(1);
 }
 
 int main(int argc, char **argv)
 {
 	struct passwd	*pwd;
-	struct __lockargs args = { 0 };
 	gid_t		gid, egid;
 	char		*lockfile = NULL;
 	char		**cmd = NULL;
 	int 		c, r;
 	int		retries = 5;
 	int		interval = 0;
+	long		timeout = -1;
+	int		retries_set = 0;
 	int		flags = 0;
 	int		lock = 0;
 	int		unlock = 0;
@@ -191,6 +384,12 @@ int main(int argc, char **argv)
 	int		touch = 0;
 	int		writepid = 0;
 	int		passthrough = 0;
+	int		execmode = 0;
+	int		sock = 0;
+	int		sweep = 0;
+	int		refresh = 30;
+	int		touchfd = -1;
+	sigset_t	sigs, oldsigs;
 
 	/*
 	 *	Remember real and effective gid, and
@@ -214,7 +413,20 @@ int main(int argc, char **argv)
 	/*
 	 *	Process the options.
 	 */
-	while ((c = getopt(argc, argv, "+qpNr:mluci:tP")) != EOF) switch(c) {
+#ifdef HAVE_GETOPT_H
+	static struct option longopts[] = {
+		{ "timeout",	required_argument,	NULL,	'T' },
+		{ "refresh",	required_argument,	NULL,	'R' },
+		{ "exec",	no_argument,		NULL,	'E' },
+		{ "socket",	no_argument,		NULL,	'S' },
+		{ "gc",		no_argument,		NULL,	'g' },
+		{ NULL,		0,			NULL,	0 }
+	};
+	while ((c = getopt_long(argc, argv, "+qpNr:mluci:tPT:R:ESg",
+			longopts, NULL)) != EOF) switch(c) {
+#else
+	while ((c = getopt(argc, argv, "+qpNr:mluci:tPT:R:ESg")) != EOF) switch(c) {
+#endif
 		case 'q':
 			quiet = 1;
 			break;
@@ -225,6 +437,7 @@ int main(int argc, char **argv)
 			/* NOP */
 			break;
 		case 'r':
+			retries_set = 1;
 			retries = atoi(optarg);
 			if (retries <= 0 &&
 			    retries != -1 && strcmp(optarg, "0") != 0) {
@@ -268,7 +481,6 @@ int main(int argc, char **argv)
 				return L_ERROR;
 			}
 			flags |= __L_INTERVAL;
-			args.interval = interval;
 			break;
 		case 't':
 			touch = 1;
@@ -276,6 +488,35 @@ int main(int argc, char **argv)
 		case 'P':
 			passthrough = 1;
 			break;
+		case 'E':
+			execmode = 1;
+			break;
+		case 'S':
+			sock = 1;
+			break;
+		case 'g':
+			sweep = 1;
+			break;
+		case 'R':
+			refresh = atoi(optarg);
+			if (refresh <= 0 && strcmp(optarg, "0") != 0) {
+				if (!quiet)
+					fprintf(stderr, "dotlockfile: "
+						"-R %s: invalid argument\n",
+						optarg);
+				return L_ERROR;
+			}
+			break;
+		case 'T':
+			timeout = atol(optarg);
+			if (timeout <= 0 && strcmp(optarg, "0") != 0) {
+				if (!quiet)
+					fprintf(stderr, "dotlockfile: "
+						"--timeout %s: invalid argument\n",
+						optarg);
+				return L_ERROR;
+			}
+			break;
 		default:
 			usage();
 			break;
@@ -301,10 +542,49 @@ int main(int argc, char **argv)
 	 */
 	if ((cmd || lock) && (touch || check || unlock))
 		usage();
+	if (execmode && (!cmd || passthrough))
+		usage();
+	/* an abstract lock goes away when we exit */
+	if (sock && (touch || unlock || (lock && !cmd)))
+		usage();
+
+	if (sweep && (cmd || lock || touch || check || unlock || sock))
+		usage();
+
+	/*
+	 *	Remove orphaned temp lockfiles from a directory. This
+	 *	never needs the mail group; run it as the owner of the
+	 *	files, or as root.
+	 */
+	if (sweep) {
+		if (gid != egid && setgid(gid) != 0)
+			perror_exit("setgid");
+		if (tmp_sweep(lockfile, NULL, 0, NULL) < 0) {
+			if (!quiet)
+				fprintf(stderr, "dotlockfile: %s: %s\n",
+					lockfile, strerror(errno));
+			return L_ERROR;
+		}
+		return 0;
+	}
 
 	if (writepid)
 		flags |= (cmd ? L_PID : L_PPID);
 
+	/* in exec mode, the command inherits a holder fd */
+	if (sock) {
+		flags = (flags & ~(L_PID|L_PPID)) | __L_ABSTRACT;
+		refresh = 0;
+	} else if (execmode)
+		flags |= __L_HOLDFD;
+
+	/* without -r, keep trying until the timeout */
+	if (timeout >= 0) {
+		flags |= __L_DEADLINE;
+		if (!retries_set)
+			retries = -1;
+	}
+
 #ifdef MAXPATHLEN
 	if (strlen(lockfile) >= MAXPATHLEN) {
 		if (!quiet)
@@ -319,7 +599,7 @@ int main(int argc, char **argv)
 	int cwd_fd = -1;
 	int need_privs = 0;
 #ifdef MAILGROUP
-	if (gid != egid) {
+	if (gid != egid && !sock) {
 		/*
 		 *	See if the requested lock is for a mailbox.
 		 *	First, remember currect working directory.
@@ -390,63 +670,90 @@ int main(int argc, char **argv)
 	/*
 	 *	No, lock.
 	 */
-	r = lockfile_create_set_tmplock(lockfile, &tmplock, retries, flags, &args);
+	r = lockfile_handle_init(&lh, lockfile, flags);
+	if (r != 0) {
+		if (!quiet)
+			perror("dotlockfile");
+		return r;
+	}
+	lh.args.interval = interval;
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &lh.args.deadline);
+		lh.args.deadline.tv_sec += timeout / 1000;
+		lh.args.deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if (lh.args.deadline.tv_nsec >= 1000000000L) {
+			lh.args.deadline.tv_sec++;
+			lh.args.deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	r = lockfile_handle_acquire(&lh, retries);
 	if (r != 0 || !cmd)
 		return r;
 
+	/* touch through an fd, so we never touch someone else's lock */
+	if (!writepid && refresh > 0)
+		touchfd = open(lockfile, O_RDONLY|O_CLOEXEC);
+
+	/*
+	 *	Exec mode: become the command. The lock stays alive as
+	 *	long as the command keeps the inherited holder fd open
+	 *	(and/or, with -p, as long as its pid exists). Without
+	 *	either, a supervisor touches it while the command runs.
+	 */
+	if (execmode) {
+		if (lh.args.fd < 0 && touchfd >= 0)
+			exec_supervisor(touchfd, refresh);
+		if (lh.args.fd >= 0) {
+			char fdbuf[16];
+
+			fcntl(lh.args.fd, F_SETFD, 0);
+			snprintf(fdbuf, sizeof(fdbuf), "%d", lh.args.fd);
+			setenv("DOTLOCKFILE_FD", fdbuf, 1);
+		}
+		run_command(cmd, gid, egid, cwd_fd);
+		lockfile_handle_release(&lh);
+		exit(127);
+	}
 
 	/*
 	 *	Spawn command.
 	 *
 	 *	Using an empty signal handler means that we ignore the
 	 *	signal, but that it's restored to SIG_DFL at execve().
+	 *	If we can use a signalfd, the signals are blocked
+	 *	instead; the child unblocks them before execve().
 	 */
 	set_signal(SIGINT, ignore_signal);
 	set_signal(SIGQUIT, ignore_signal);
 	set_signal(SIGHUP, ignore_signal);
 	set_signal(SIGALRM, ignore_signal);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGQUIT);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigs, &oldsigs);
 
 	pid_t pid = fork();
 	if (pid < 0) {
 		if (!quiet)
 			perror("fork");
-		lockfile_remove(lockfile);
+		lockfile_handle_release(&lh);
 		exit(L_ERROR);
 	}
 	if (pid == 0) {
-		/* drop setgid */
-		if (gid != egid && setgid(gid) < 0) {
-			perror("setgid");
-			exit(127);
-		}
-		/* restore current working directory */
-		if (cwd_fd >= 0) {
-			if (fchdir(cwd_fd) < 0) {
-				perror("dotlockfile: restoring cwd:");
-				exit(127);
-			}
-			close(cwd_fd);
-		}
-		/* exec */
-		execvp(cmd[0], cmd);
-		perror(cmd[0]);
+		/* the lock belongs to the parent */
+		lh.locked = 0;
+		sigprocmask(SIG_SETMASK, &oldsigs, NULL);
+		run_command(cmd, gid, egid, cwd_fd);
 		exit(127);
 	}
 
 	/* wait for child */
-	int e, wstatus;
-	while (1) {
-		if (!writepid)
-			alarm(30);
-		e = waitpid(pid, &wstatus, 0);
-		if (e >= 0 || errno != EINTR)
-			break;
-		if (!writepid)
-			lockfile_touch(lockfile);
-	}
+	int wstatus = supervise(pid, touchfd, writepid ? 0 : refresh,
+				&sigs, &oldsigs);
 
-	alarm(0);
-	lockfile_remove(lockfile);
+	lockfile_handle_release(&lh);
 
 	if (passthrough) {
 		if (WIFEXITED(wstatus))
@@ -456,4 +763,3 @@ int main(int argc, char **argv)
 	}
 	return 0;
 }
-
@@ -0,0 +1,145 @@
+/*
+ * hpptest.cpp	Build and run a few uses of lockfile.hpp, so that the
+ *		header is compiled by "make test": the RAII lock, the
+ *		awaitable with a scheduler that meets the concept and
+ *		nothing more, and stopped early, and basic_lockfile.
+ *
+ *		Copyright (C) Miquel van Smoorenburg and contributors 1999-2021
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version 2
+ *		of the License, or (at your option) any later version.
+ */
+
+#include <lockfile.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+static int	failed;
+
+#define CHECK(x) do { \
+	if (!(x)) { \
+		std::fprintf(stderr, "hpptest: line %d: %s\n", __LINE__, #x); \
+		failed++; \
+	} \
+} while (0)
+
+/*
+ *	Just schedule_after(), with a std::function; run() sleeps
+ *	and calls them in order.
+ */
+struct tiny_scheduler {
+	std::vector<std::pair<lockfile::clock::duration,
+		std::function<void()>>>	q;
+
+	void schedule_after(lockfile::clock::duration d,
+			std::function<void()> f)
+	{
+		q.emplace_back(d, std::move(f));
+	}
+
+	void run()
+	{
+		while (!q.empty()) {
+			auto e = std::move(q.front());
+			q.erase(q.begin());
+			std::this_thread::sleep_for(e.first);
+			e.second();
+		}
+	}
+};
+static_assert(lockfile::scheduler<tiny_scheduler>);
+
+struct task {
+	struct promise_type {
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::abort(); }
+	};
+};
+
+static task waiter(const std::string &path, tiny_scheduler &s, bool &got)
+{
+	lockfile::backoff b;
+
+	b.initial = b.step = std::chrono::milliseconds(10);
+	lockfile::lock l = co_await lockfile::async_acquire<tiny_scheduler>(
+		path, s, lockfile::clock::now() + std::chrono::seconds(5),
+		{}, L_PID, b);
+	got = l.owns_lock();
+}
+
+static task stoppable(const std::string &path, tiny_scheduler &s,
+		std::stop_token st, std::error_code &ec)
+{
+	lockfile::backoff b;
+
+	b.initial = std::chrono::seconds(60);
+	try {
+		co_await lockfile::async_acquire<tiny_scheduler>(path, s,
+			lockfile::clock::now() + std::chrono::minutes(5),
+			st, L_PID, b);
+	} catch (const std::system_error &e) {
+		ec = e.code();
+	}
+}
+
+int main()
+{
+	char			dir[] = "/tmp/hpptestXXXXXX";
+	std::error_code		ec;
+	tiny_scheduler		s;
+	bool			got = false;
+
+	if (mkdtemp(dir) == nullptr) {
+		std::perror("hpptest: mkdtemp");
+		return 1;
+	}
+	std::string path = std::string(dir) + "/test.lock";
+
+	{
+		lockfile::basic_lockfile<> held(path);
+		CHECK(held.try_lock());
+		CHECK(lockfile::basic_lockfile<>::held(path));
+
+		/* a stop request doesn't wait for the next attempt */
+		std::stop_source	ss;
+		std::error_code		sec;
+		stoppable(path, s, ss.get_token(), sec);
+		CHECK(!sec && s.q.size() == 1);
+		ss.request_stop();
+		CHECK(sec == std::errc::operation_canceled);
+		/* and the attempt that was still scheduled does nothing */
+		auto pending = std::move(s.q.front().second);
+		s.q.clear();
+		pending();
+		CHECK(s.q.empty());
+
+		/* contended: the awaitable has to go through the scheduler */
+		waiter(path, s, got);
+		CHECK(!got);
+		CHECK(!s.q.empty());
+		held.unlock();
+		s.run();
+		CHECK(got);
+	}
+	CHECK(!lockfile::basic_lockfile<>::held(path));
+
+	lockfile::lock l = lockfile::lock::try_acquire(path, L_PID, ec);
+	CHECK(!ec && l.owns_lock());
+	lockfile::lock l2 = lockfile::lock::try_acquire(path, L_PID, ec);
+	CHECK(lockfile::contended(ec) && !l2.owns_lock());
+	l.release();
+
+	/* an invalid flag must come back as EINVAL, not "unknown error" */
+	lockfile::lock l3 = lockfile::lock::try_acquire(path, 1 << 30, ec);
+	CHECK(ec == std::errc::invalid_argument);
+
+	rmdir(dir);
+	return failed ? 1 : 0;
+}
@@ -18,6 +18,7 @@
 #include <sys/param.h>
 #endif
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -28,6 +29,11 @@
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <sched.h>
 #include <lockfile.h>
 #include <maillock.h>
 
@@ -35,15 +41,47 @@
 #include <utime.h>
 #endif
 
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#define LOCKSOCK
+#endif
+#ifndef NFS_SUPER_MAGIC
+#define NFS_SUPER_MAGIC		0x6969
+#endif
+
+#if defined(LIB) && defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#ifdef SYS_futex
+#define LOCKTABLE
+#define LOCKBOARD
+#endif
+#endif
+
 #ifdef LIB
 static char *mlockfile;
 static int  islocked = 0;
+static int  mboxfd = -1;
 #endif
 
 #ifndef LIB
 extern int check_sleep(int, int);
 #endif
 
+#ifdef LOCKFILE_TEST
+/*
+ *	Test build: the stress harness can replace the clock used
+ *	for the stale check and the sleep between retries.
+ */
+time_t	(*lockfile_test_time)(time_t *) = time;
+void	(*lockfile_test_sleep)(long ms) = NULL;
+#define time(t)		lockfile_test_time(t)
+#endif
+
 #ifdef MAILGROUP
 /*
  *	Get the id of the mailgroup, by statting the helper program.
@@ -176,10 +214,20 @@ static int run_helper(char *opt, const char *lockfile, int retries, int flags)
 #define TMPLOCKFILENAMESZ	(TMPLOCKSTRSZ + TMPLOCKPIDSZ + \
 				 TMPLOCKTIMESZ + TMPLOCKSYSNAMESZ)
 
+/* second line of a lockfile that is kept alive by an OFD lock */
+#define LOCKOFDSTR		"lock=ofd"
+/* start time and pid namespace of the process in the lockfile */
+#define LOCKSTARTSTR		"start="
+#define LOCKPIDNSSTR		"pidns="
+
+/* goes into the hex digit, so that the next try gets another name */
+static unsigned int	tmp_serial;
+
 static int lockfilename(const char *lockfile, char *tmplock, int tmplocksz)
 {
 	char		sysname[256];
 	char		*p;
+	unsigned int	n;
 
 #ifdef MAXPATHLEN
 	/*
@@ -210,9 +258,10 @@ static int lockfilename(const char *lockfile, char *tmplock, int tmplocksz)
 		p = tmplock;
 	else
 		p++;
+	n = __atomic_fetch_add(&tmp_serial, 1, __ATOMIC_RELAXED);
 	if (snprintf(p, TMPLOCKFILENAMESZ, "%s%0*d%0*x%s", TMPLOCKSTR,
 			TMPLOCKPIDSZ, (int)getpid(),
-			TMPLOCKTIMESZ, (int)time(NULL) & 15,
+			TMPLOCKTIMESZ, (int)(time(NULL) + n) & 15,
 			sysname) < 0) {
 		// never happens but gets rid of gcc truncation warning.
 		errno = EOVERFLOW;
@@ -223,309 +272,2988 @@ static int lockfilename(const char *lockfile, char *tmplock, int tmplocksz)
 }
 
 /*
- *	Create a lockfile.
+ *	Move a temp lockfile name on to the next value of its hex
+ *	digit, which follows the pid.
  */
-static int lockfile_create_save_tmplock(const char *lockfile,
-		char *tmplock, int tmplocksz,
-		volatile char **xtmplock,
-		int retries, int flags, struct __lockargs *args)
+static void tmp_nextname(char *tmplock)
 {
-	struct stat	st, st1;
-	char		pidbuf[40];
-	pid_t		pid = 0;
-	int		sleeptime = 0;
-	int		statfailed = 0;
-	int		fd;
-	int		i, e, pidlen;
-	int		dontsleep = 1;
-	int		tries = retries + 1;
-
-	/* process optional flags that have arguments */
-	if (flags & __L_INTERVAL) {
-		sleeptime = args->interval;
-	}
+	char		*p;
+	int		n;
 
-	/* decide which PID to write to the lockfile */
-	if (flags & L_PID)
-		pid = getpid();
-	if (flags & L_PPID) {
-		pid = getppid();
-		if (pid == 1) {
-			/* orphaned */
-			return L_ORPHANED;
-		}
-	}
-	pidlen = snprintf(pidbuf, sizeof(pidbuf), "%d\n", pid);
-	if (pidlen > sizeof(pidbuf) - 1) {
-		errno = EOVERFLOW;
-		return L_ERROR;
-	}
+	if ((p = strrchr(tmplock, '/')) == NULL)
+		p = tmplock;
+	else
+		p++;
+	p += TMPLOCKSTRSZ + snprintf(NULL, 0, "%0*d",
+					TMPLOCKPIDSZ, (int)getpid());
+	n = (*p >= 'a') ? *p - 'a' + 10 : *p - '0';
+	*p = "0123456789abcdef"[(n + 1) & 15];
+}
 
-	/* create temporary lockfile */
-	if ((i = lockfilename(lockfile, tmplock, tmplocksz)) != 0)
-		return i;
-	if (xtmplock)
-		*xtmplock = tmplock;
-	fd = open(tmplock, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
-	if (fd < 0) {
-		/* permission denied? perhaps try suid helper */
-#if defined(LIB) && defined(MAILGROUP)
-		if (errno == EACCES && is_maillock(lockfile))
-			return run_helper("-l", lockfile, retries, flags);
-#endif
-		return L_TMPLOCK;
-	}
-	i = write(fd, pidbuf, pidlen);
-	e = errno;
+#ifdef F_OFD_SETLK
+/*
+ *	Put an OFD write lock on the (temporary) lockfile, so that
+ *	as long as we keep this fd open, lockfile_check() can see
+ *	that the lock is alive with a single fcntl(). Not on NFS,
+ *	where lock state is not reliably shared between clients.
+ *	Returns 1 if locked, 0 if not, -1 on error.
+ */
+static int holder_lock(int fd)
+{
+	struct statfs	sfs;
+	struct flock	fl;
 
-	if (close(fd) != 0) {
-		e = errno;
-		i = -1;
-	}
-	if (i != pidlen) {
-		unlink(tmplock);
-		tmplock[0] = 0;
-		errno = i < 0 ? e : EAGAIN;
-		return L_TMPWRITE;
-	}
+	if (fstatfs(fd, &sfs) == 0 && sfs.f_type == NFS_SUPER_MAGIC)
+		return 0;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	return fcntl(fd, F_OFD_SETLK, &fl) < 0 ? -1 : 1;
+}
 
-	/*
-	 *	Now try to link the temporary lock to the lock.
-	 */
-	for (i = 0; i < tries && tries > 0; i++) {
-		if (!dontsleep) {
-			if (!(flags & __L_INTERVAL))
-				sleeptime += 5;
+/*
+ *	See if a lockfile that was created with L_HOLDFD is still
+ *	held. Returns 1 if so, 0 if it's stale, -1 if we can't
+ *	tell (lockfile is on NFS).
+ */
+static int holder_alive(int fd)
+{
+	struct statfs	sfs;
+	struct flock	fl;
 
-			if (sleeptime > 60) sleeptime = 60;
-#ifdef LIB
-			sleep(sleeptime);
-#else
-			if ((e = check_sleep(sleeptime, flags)) != 0) {
-				unlink(tmplock);
-				tmplock[0] = 0;
-				return e;
-			}
+	if (fstatfs(fd, &sfs) < 0 || sfs.f_type == NFS_SUPER_MAGIC)
+		return -1;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(fd, F_OFD_GETLK, &fl) < 0)
+		return -1;
+	return fl.l_type != F_UNLCK;
+}
 #endif
-		}
-		dontsleep = 0;
-
-
-		/*
-		 *	Now lock by linking the tempfile to the lock.
-		 *
-		 *	KLUDGE: some people say the return code of
-		 *	link() over NFS can't be trusted.
-		 *	EXTRA FIX: the value of the nlink field
-		 *	can't be trusted (may be cached).
-		 */
-		(void)!link(tmplock, lockfile);
-
-		if (lstat(tmplock, &st1) < 0) {
-			tmplock[0] = 0;
-			return L_ERROR; /* Can't happen */
-		}
-
-		if (lstat(lockfile, &st) < 0) {
-			if (statfailed++ > 5) {
-				/*
-				 *	Normally, this can't happen; either
-				 *	another process holds the lockfile or
-				 *	we do. So if this error pops up
-				 *	repeatedly, just exit...
-				 */
-				e = errno;
-				(void)unlink(tmplock);
-				tmplock[0] = 0;
-				errno = e;
-				return L_MAXTRYS;
-			}
-			continue;
-		}
-
-		/*
-		 *	See if we got the lock.
-		 */
-		if (st.st_rdev == st1.st_rdev &&
-		    st.st_ino  == st1.st_ino) {
-			(void)unlink(tmplock);
-			tmplock[0] = 0;
-			return L_SUCCESS;
-		}
-		statfailed = 0;
 
-		/*
-		 *	If there is a lockfile and it is invalid,
-		 *	remove the lockfile.
-		 */
-		if (lockfile_check(lockfile, flags) == -1) {
-			if (unlink(lockfile) < 0 && errno != ENOENT) {
-				/*
-				 *	we failed to unlink the stale
-				 *	lockfile, give up.
-				 */
-				return L_RMSTALE;
-			}
-			dontsleep = 1;
-			/*
-			 *	If the lockfile was invalid, then the first
-			 *	try wasn't valid either - make sure we
-			 *	try at least once more.
-			 */
-			if (tries == 1) tries++;
-		}
+/*
+ *	Milliseconds left until a CLOCK_MONOTONIC deadline.
+ */
+static long deadline_left(const struct timespec *deadline)
+{
+	struct timespec	now;
 
-	}
-	(void)unlink(tmplock);
-	tmplock[0] = 0;
-	errno = EAGAIN;
-	return L_MAXTRYS;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (deadline->tv_sec - now.tv_sec) * 1000L +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000L;
 }
 
-#ifdef LIB
-static
-#endif
-int lockfile_create_set_tmplock(const char *lockfile, volatile char **xtmplock, int retries, int flags, struct __lockargs *args)
+/*
+ *	Tiny spin lock for the process-local tables below. Critical
+ *	sections are a few loads and stores, so yield rather than burn
+ *	the CPU of whoever holds it.
+ */
+static void spin_lock(int *busy)
 {
-	char *tmplock;
-	int l, r, e;
-
-	l = strlen(lockfile)+TMPLOCKFILENAMESZ+1;
-	if ((tmplock = (char *)malloc(l)) == NULL)
-		return L_ERROR;
-	tmplock[0] = 0;
-	r = lockfile_create_save_tmplock(lockfile,
-						tmplock, l, xtmplock, retries, flags, args);
-	if (xtmplock)
-		*xtmplock = NULL;
-	e = errno;
-	free(tmplock);
-	errno = e;
-	return r;
+	while (__atomic_exchange_n(busy, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
 }
 
-#ifdef LIB
-int lockfile_create(const char *lockfile, int retries, int flags)
+static void spin_unlock(int *busy)
 {
-	/* check against unknown flags */
-	if (flags & ~(L_PID|L_PPID)) {
-		errno = EINVAL;
-		return L_ERROR;
-	}
-	return lockfile_create_set_tmplock(lockfile, NULL, retries, flags, NULL);
+	__atomic_store_n(busy, 0, __ATOMIC_RELEASE);
 }
 
-#ifdef STATIC
-int lockfile_create2(const char *lockfile, int retries,
-		int flags, struct __lockargs *args, int args_sz)
+static unsigned int fnv_hash(const char *name)
 {
+	unsigned int	h = 2166136261u;
 
-	#define FLAGS_WITH_ARGS (__L_INTERVAL)
-	#define KNOWN_FLAGS (L_PID|L_PPID|__L_INTERVAL)
-
-	/* check if size is the same (version check) */
-	if (args != NULL && sizeof(struct __lockargs) != args_sz) {
-		errno = EINVAL;
-		return L_ERROR;
-	}
-	/* some flags _must_ have a non-null args */
-	if (args == NULL && (flags & FLAGS_WITH_ARGS)) {
-		errno = EINVAL;
-		return L_ERROR;
-	}
-	/* check against unknown flags */
-	if (flags & ~KNOWN_FLAGS) {
-		errno = EINVAL;
-		return L_ERROR;
+	/* FNV-1a */
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
 	}
-	return lockfile_create_set_tmplock(lockfile, NULL, retries, flags, args);
+	return h;
 }
-#endif
 
+#if defined(LOCKTABLE) || defined(LOCKBOARD)
+static long futex(int *uaddr, int op, int val, const struct timespec *ts)
+{
+	return syscall(SYS_futex, uaddr, op, val, ts, NULL, 0);
+}
 #endif
 
 /*
- *	See if a valid lockfile is present.
- *	Returns 0 if so, -1 if not.
+ *	One slot of the wait board. "seq" goes up every time a lock
+ *	that hashes to this slot is removed; waiters sleep on it.
  */
-int lockfile_check(const char *lockfile, int flags)
+struct board_slot {
+	int		seq;
+	int		waiters;
+};
+
+#ifdef LOCKBOARD
+/*
+ *	Wait board (L_BOARD). Processes of one user on this host that
+ *	wait for a lockfile in the same directory share a small file in
+ *	/dev/shm, named after the uid and the device and inode of the
+ *	directory, with one
+ *	futex per slot. lockfile_remove() bumps the slot of the lock
+ *	and wakes the waiters, so they don't have to sleep out their
+ *	retry interval. The lockfile is still what decides who has the
+ *	lock: a waiter that isn't woken up (holder on another host, or
+ *	one that doesn't use the board) just times out and polls.
+ */
+#define BOARD_MAGIC	0x4c4b4231	/* "LKB1" */
+#define BOARD_SLOTS	254
+#define BOARD_DIRS	8
+#define BOARD_PATHSZ	512
+#define BOARD_RECHECK	2	/* secs a missing board is believed	*/
+
+struct board {
+	int			magic;
+	int			nslots;
+	struct board_slot	slot[BOARD_SLOTS];
+};
+
+static struct {
+	unsigned int	hash;
+	char		dir[BOARD_PATHSZ];
+	struct board	*b;		/* NULL: there was none		*/
+	time_t		checked;	/* when that was found		*/
+} board_dirs[BOARD_DIRS];
+static int		board_ndirs;
+static int		board_busy;
+
+/*
+ *	Length of the directory part of "lockfile", up to (but not
+ *	including) the last slash. 0 means the current directory.
+ */
+static int board_dirlen(const char *lockfile)
 {
-	struct stat	st, st2;
-	char		buf[16];
-	time_t		now;
-	pid_t		pid;
-	int		fd, len, r;
+	const char	*p = strrchr(lockfile, '/');
 
-	if (stat(lockfile, &st) < 0)
-		return -1;
+	return p ? (p == lockfile ? 1 : p - lockfile) : 0;
+}
 
+/*
+ *	Map the board for the directory "dir" (NULL if we can't). Only
+ *	with "create" is it made if it isn't there yet.
+ */
+static struct board *board_map(const char *dir, int create)
+{
+	struct board	*b;
+	struct stat	st;
+	const char	*shm[] = { "/dev/shm", getenv("XDG_RUNTIME_DIR") };
+	char		name[BOARD_PATHSZ + 64];
+	int		fd = -1, i;
+
+	if (stat(dir, &st) < 0)
+		return NULL;
+	for (i = 0; i < 2 && fd < 0; i++) {
+		if (shm[i] == NULL)
+			continue;
+		snprintf(name, sizeof(name), "%s/lockfile-board.%u.%llx.%llx",
+			shm[i], (unsigned int)geteuid(),
+			(unsigned long long)st.st_dev,
+			(unsigned long long)st.st_ino);
+		fd = open(name, O_RDWR|O_NOFOLLOW|O_CLOEXEC|
+				(create ? O_CREAT : 0), 0600);
+	}
+	if (fd < 0)
+		return NULL;
 	/*
-	 *	Get the contents and mtime of the lockfile.
+	 *	Anyone who can write to the board can SIGBUS us by
+	 *	truncating it, so only use a file that is ours alone.
+	 *	Someone else squatting on the name just costs us the board.
 	 */
-	time(&now);
-	pid = 0;
-	if ((fd = open(lockfile, O_RDONLY)) >= 0) {
-		/*
-		 *	Try to use 'atime after read' as now, this is
-		 *	the time of the filesystem. Should not get
-		 *	confused by 'atime' or 'noatime' mount options.
-		 */
-		len = 0;
-		if (fstat(fd, &st) == 0 &&
-		    (len = read(fd, buf, sizeof(buf))) >= 0 &&
-		    fstat(fd, &st2) == 0 &&
-		    st.st_atime != st2.st_atime)
-			now = st.st_atime;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & 077) || st.st_nlink != 1 ||
+	    (st.st_size != 0 && st.st_size != (off_t)sizeof(*b)) ||
+	    (st.st_size == 0 && ftruncate(fd, sizeof(*b)) < 0)) {
 		close(fd);
-		if (len > 0 && (flags & (L_PID|L_PPID))) {
-			buf[len] = 0;
-			pid = atoi(buf);
-		}
+		return NULL;
+	}
+	b = mmap(NULL, sizeof(*b), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (b == MAP_FAILED)
+		return NULL;
+	/* new file: all zeroes, so no one can be waiting on it yet */
+	if (__atomic_load_n(&b->magic, __ATOMIC_SEQ_CST) == 0) {
+		b->nslots = BOARD_SLOTS;
+		__atomic_store_n(&b->magic, BOARD_MAGIC, __ATOMIC_SEQ_CST);
 	}
+	if (b->magic != BOARD_MAGIC || b->nslots != BOARD_SLOTS) {
+		munmap(b, sizeof(*b));
+		return NULL;
+	}
+	return b;
+}
 
-	if (pid > 0) {
-		/*
-		 *	If we have a pid, see if the process
-		 *	owning the lockfile is still alive.
-		 */
-		r = kill(pid, 0);
-		if (r == 0 || errno == EPERM)
-			return 0;
-		if (r < 0 && errno == ESRCH)
-			return -1;
-		/* EINVAL - FALLTHRU */
+/*
+ *	Find the board slot of "lockfile", mapping the board of its
+ *	directory if this process didn't have it yet. With "create"
+ *	(a waiter) the board is made if needed; without (a remover)
+ *	only one that a waiter made is used. That there is none is
+ *	remembered for BOARD_RECHECK seconds, so that removing lock
+ *	after lock in a directory nobody waits in costs nothing.
+ */
+static struct board_slot *board_slot(const char *lockfile, int create)
+{
+	struct board	*b = NULL;
+	char		dir[BOARD_PATHSZ];
+	unsigned int	h;
+	time_t		now = time(NULL);
+	int		len, i, n;
+
+	if ((len = board_dirlen(lockfile)) >= BOARD_PATHSZ)
+		return NULL;
+	if (len == 0)
+		strcpy(dir, ".");
+	else {
+		memcpy(dir, lockfile, len);
+		dir[len] = 0;
 	}
+	h = fnv_hash(dir);
 
-	/*
-	 *	Without a pid in the lockfile, the lock
-	 *	is valid if it is newer than 5 mins.
-	 */
+	spin_lock(&board_busy);
+	n = board_ndirs;
+	for (i = 0; i < n; i++)
+		if (board_dirs[i].hash == h &&
+		    strcmp(board_dirs[i].dir, dir) == 0)
+			break;
+	if (i < n)
+		b = board_dirs[i].b;
+	if (b == NULL && (create || i == n ||
+			  now - board_dirs[i].checked >= BOARD_RECHECK) &&
+	    (i < n || n < BOARD_DIRS)) {
+		b = board_map(dir, create);
+		if (i == n) {
+			board_dirs[n].hash = h;
+			strcpy(board_dirs[n].dir, dir);
+			board_ndirs = n + 1;
+		}
+		board_dirs[i].b = b;
+		board_dirs[i].checked = now;
+	}
+	spin_unlock(&board_busy);
 
-	if (now < st.st_mtime + 300)
-		return 0;
+	if (b == NULL)
+		return NULL;
+	return &b->slot[fnv_hash(lockfile + (len ? len + 1 : 0)) % BOARD_SLOTS];
+}
 
-	return -1;
+/*
+ *	Called after the lockfile was removed. One waiter is woken,
+ *	waking them all makes them fight over the lockfile. If that
+ *	one was waiting for another lock in the same slot, or is just
+ *	giving up, the others find out when their retry interval ends.
+ */
+static void board_wake(const char *lockfile)
+{
+	struct board_slot	*bs;
+
+	if ((bs = board_slot(lockfile, 0)) == NULL)
+		return;
+	__atomic_add_fetch(&bs->seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&bs->waiters, __ATOMIC_SEQ_CST) > 0)
+		futex(&bs->seq, FUTEX_WAKE, 1, NULL);
 }
 
 /*
- *	Remove a lock.
+ *	Wait at most "ms" milliseconds for the slot to move on from
+ *	"seq", which was read before the last attempt to get the lock,
+ *	so a remove in between is never missed.
  */
-int lockfile_remove(const char *lockfile)
+static int board_wait(struct board_slot *bs, int seq, long ms,
+		int flags, struct __lockargs *args)
 {
-	if (unlink(lockfile) < 0) {
-#if defined(LIB) && defined(MAILGROUP)
-		if (errno == EACCES && is_maillock(lockfile))
-			return run_helper("-u", lockfile, 0, 0);
+	struct timespec	ts, end;
+	struct pollfd	pfd;
+	long		left;
+	int		r = 0;
+
+#ifdef LOCKFILE_TEST
+	/* the stress harness turns seconds into milliseconds */
+	if (lockfile_test_sleep)
+		ms = (ms + 999) / 1000;
 #endif
-		return errno == ENOENT ? 0 : -1;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += ms / 1000;
+	end.tv_nsec += (ms % 1000) * 1000000L;
+	if (end.tv_nsec >= 1000000000L) {
+		end.tv_sec++;
+		end.tv_nsec -= 1000000000L;
 	}
-	return 0;
+
+	__atomic_add_fetch(&bs->waiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&bs->seq, __ATOMIC_SEQ_CST) == seq &&
+	       (left = deadline_left(&end)) > 0) {
+		if (flags & __L_CANCELFD) {
+			pfd.fd = args->cancelfd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 0) > 0) {
+				errno = ECANCELED;
+				r = L_CANCELLED;
+				break;
+			}
+			/* look at the cancel fd now and then */
+			if (left > 100)
+				left = 100;
+		}
+		ts.tv_sec = left / 1000;
+		ts.tv_nsec = (left % 1000) * 1000000L;
+		futex(&bs->seq, FUTEX_WAIT, seq, &ts);
+	}
+	__atomic_sub_fetch(&bs->waiters, 1, __ATOMIC_SEQ_CST);
+	return r;
 }
+#endif /* LOCKBOARD */
 
 /*
- *	Touch a lock.
+ *	Backoff state of one lockfile_create() call.
  */
-int lockfile_touch(const char *lockfile)
+struct backoff {
+	long		est;		/* expected hold time, ms, or 0	*/
+	long		step;		/* next sleep once that is over	*/
+	long		base;		/* first step, est / 4		*/
+	long		mtime;		/* lockfile we last saw, ms	*/
+	long		seen;		/* and when we saw it, ms	*/
+	long		start;		/* CLOCK_MONOTONIC, ms		*/
+	int		waited;		/* we had to wait		*/
+};
+
+static long clock_ms(clockid_t clk)
+{
+	struct timespec	ts;
+
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+#ifdef LIB
+/*
+ *	Adaptive backoff (L_ADAPTIVE). For every lock path this process
+ *	used, keep a moving average of how long the lock is held, both
+ *	by us (lockfile_create() to lockfile_remove()) and by others (the
+ *	mtime of the lockfile we waited for, to when it was gone). Waiters
+ *	then sleep until the current lockfile is expected to go away, and
+ *	back off from there. Slots are keyed by a hash of the name as
+ *	given; a collision only makes the estimate worse.
+ */
+#define AB_SLOTS	64
+
+struct ab_slot {
+	unsigned int	hash;
+	unsigned int	acquired;	/* times we got the lock	*/
+	unsigned int	contended;	/* and had to wait for it	*/
+	unsigned int	samples;	/* hold times seen		*/
+	long		hold;		/* average hold time, ms	*/
+	long		wait;		/* average wait if contended	*/
+	long		heldat;		/* we hold it since, ms		*/
+};
+
+static struct ab_slot	ab_table[AB_SLOTS];
+static int		ab_inuse;
+static int		ab_busy;
+
+static void ab_lock(void)
+{
+	spin_lock(&ab_busy);
+}
+
+static void ab_unlock(void)
+{
+	spin_unlock(&ab_busy);
+}
+
+/*
+ *	Find the slot for "hash". With "create", take a free one or
+ *	the least used one. Call with the table locked.
+ */
+static struct ab_slot *ab_find(unsigned int hash, int create)
+{
+	struct ab_slot	*s, *victim = NULL;
+	int		i;
+
+	for (i = 0; i < AB_SLOTS; i++) {
+		s = &ab_table[(hash + i) % AB_SLOTS];
+		if (s->hash == hash)
+			return s;
+		if (victim == NULL || s->acquired < victim->acquired)
+			victim = s;
+		if (s->hash == 0)
+			break;
+	}
+	if (!create)
+		return NULL;
+	if (victim->hash == 0)
+		__atomic_add_fetch(&ab_inuse, 1, __ATOMIC_SEQ_CST);
+	memset(victim, 0, sizeof(*victim));
+	victim->hash = hash ? hash : 1;
+	return victim;
+}
+
+static void ab_sample(long *avg, long v, unsigned int n)
+{
+	/* exponentially weighted, the first few count more */
+	*avg = n == 0 ? v : *avg + (v - *avg) / (n < 4 ? n + 1 : 4);
+}
+
+/*
+ *	Expected hold time of "lockfile" in ms, 0 if unknown.
+ */
+static long ab_estimate(const char *lockfile)
+{
+	struct ab_slot	*s;
+	long		est = 0;
+
+	if (__atomic_load_n(&ab_inuse, __ATOMIC_SEQ_CST) == 0)
+		return 0;
+	ab_lock();
+	if ((s = ab_find(fnv_hash(lockfile), 0)) != NULL && s->samples)
+		est = s->hold > 0 ? s->hold : 1;
+	ab_unlock();
+	return est;
+}
+
+/*
+ *	We got the lock. If we had to wait, the lockfile we saw
+ *	was held from its mtime until somewhere between when we
+ *	last saw it and now.
+ */
+static void ab_acquired(const char *lockfile, struct backoff *bo)
+{
+	struct ab_slot	*s;
+	long		now = clock_ms(CLOCK_REALTIME);
+
+	ab_lock();
+	s = ab_find(fnv_hash(lockfile), 1);
+	s->acquired++;
+	if (bo->waited) {
+		s->contended++;
+		ab_sample(&s->wait, clock_ms(CLOCK_MONOTONIC) - bo->start,
+			s->contended - 1);
+		if (bo->mtime && bo->seen >= bo->mtime && now >= bo->seen) {
+			ab_sample(&s->hold,
+				(bo->seen + now) / 2 - bo->mtime, s->samples);
+			s->samples++;
+		}
+	}
+	s->heldat = clock_ms(CLOCK_MONOTONIC);
+	ab_unlock();
+}
+
+/*
+ *	Called from lockfile_remove(): our own hold time.
+ */
+static void ab_released(const char *lockfile)
+{
+	struct ab_slot	*s;
+
+	if (__atomic_load_n(&ab_inuse, __ATOMIC_SEQ_CST) == 0)
+		return;
+	ab_lock();
+	if ((s = ab_find(fnv_hash(lockfile), 0)) != NULL && s->heldat) {
+		ab_sample(&s->hold, clock_ms(CLOCK_MONOTONIC) - s->heldat,
+			s->samples);
+		s->samples++;
+		s->heldat = 0;
+	}
+	ab_unlock();
+}
+
+int lockfile_stats_query(const char *lockfile, struct lockfile_stats *st)
+{
+	struct ab_slot	*s;
+
+	memset(st, 0, sizeof(*st));
+	st->hold_ms = -1;
+	ab_lock();
+	if ((s = ab_find(fnv_hash(lockfile), 0)) != NULL) {
+		st->hold_ms = s->samples ? s->hold : -1;
+		st->wait_ms = s->wait;
+		st->acquired = s->acquired;
+		st->contended = s->contended;
+		st->samples = s->samples;
+	}
+	ab_unlock();
+	if (s == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	Save the table to "file", so that the next process that
+ *	locks in the same spool doesn't have to learn it all again.
+ */
+int lockfile_stats_save(const char *file)
+{
+	struct ab_slot	copy[AB_SLOTS];
+	char		tmp[PATH_MAX];
+	FILE		*fp;
+	int		i, fd, e;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid()) >=
+			(int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	ab_lock();
+	memcpy(copy, ab_table, sizeof(copy));
+	ab_unlock();
+
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0)
+		return -1;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		e = errno;
+		close(fd);
+		unlink(tmp);
+		errno = e;
+		return -1;
+	}
+	fprintf(fp, "# hash acquired contended samples hold_ms wait_ms\n");
+	for (i = 0; i < AB_SLOTS; i++)
+		if (copy[i].hash && copy[i].samples)
+			fprintf(fp, "%08x %u %u %u %ld %ld\n", copy[i].hash,
+				copy[i].acquired, copy[i].contended,
+				copy[i].samples, copy[i].hold, copy[i].wait);
+	if (fclose(fp) != 0 || rename(tmp, file) < 0) {
+		e = errno;
+		unlink(tmp);
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	Load what lockfile_stats_save() wrote. Paths that this
+ *	process already has numbers for are left alone.
+ */
+int lockfile_stats_load(const char *file)
+{
+	struct ab_slot	*s, n;
+	char		line[256];
+	FILE		*fp;
+
+	if ((fp = fopen(file, "re")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		memset(&n, 0, sizeof(n));
+		if (line[0] == '#' ||
+		    sscanf(line, "%x %u %u %u %ld %ld", &n.hash, &n.acquired,
+				&n.contended, &n.samples, &n.hold, &n.wait) != 6 ||
+		    n.hash == 0 || n.samples == 0 || n.hold < 0)
+			continue;
+		ab_lock();
+		if (ab_find(n.hash, 0) == NULL) {
+			s = ab_find(n.hash, 1);
+			*s = n;
+		}
+		ab_unlock();
+	}
+	fclose(fp);
+	return 0;
+}
+#endif /* LIB */
+
+/*
+ *	How long to sleep before the next retry, in ms. The classic
+ *	schedule is 5, 10, 15 .. 60 seconds. With an estimate of the
+ *	hold time, sleep until the lockfile we saw should be gone,
+ *	then in steps of a quarter of the estimate, doubling.
+ */
+static long backoff_ms(struct backoff *bo, int *sleeptime, int flags)
+{
+	long	ms;
+
+	if (!(flags & __L_INTERVAL))
+		*sleeptime += 5;
+	if (*sleeptime > 60) *sleeptime = 60;
+
+	if (bo->est == 0 || bo->mtime == 0 || (flags & __L_INTERVAL))
+		return *sleeptime * 1000L;
+	ms = bo->mtime + bo->est - clock_ms(CLOCK_REALTIME);
+	if (ms < bo->step) {
+		ms = bo->step;
+		if (bo->step < *sleeptime * 1000L)
+			bo->step *= 2;
+	}
+	return ms < 60000 ? ms : 60000;
+}
+
+/*
+ *	A lockfile is in the way. If it's a new one, start
+ *	backing off from its expected release all over again.
+ */
+static void backoff_seen(struct backoff *bo, const struct stat *st)
+{
+	long	mtime;
+
+	if (bo->start == 0)
+		return;
+	mtime = st->st_mtim.tv_sec * 1000L + st->st_mtim.tv_nsec / 1000000L;
+	if (mtime != bo->mtime)
+		bo->step = bo->base;
+	bo->mtime = mtime;
+	bo->seen = clock_ms(CLOCK_REALTIME);
+}
+
+/*
+ *	Sleep "ms" milliseconds before the next retry, but not past
+ *	the deadline, and wake up early if the cancel fd becomes
+ *	readable. With a board slot, also wake up when the lock is
+ *	removed on this host. Returns 0, or the status lockfile_create()
+ *	should return.
+ */
+static int retry_sleep(long ms, int flags, struct __lockargs *args,
+		struct board_slot *bs, int seq)
+{
+	long		left;
+#ifdef LIB
+	struct pollfd	pfd;
+#endif
+
+	if (flags & __L_DEADLINE) {
+		if ((left = deadline_left(&args->deadline)) <= 0) {
+			errno = ETIMEDOUT;
+			return L_TIMEOUT;
+		}
+		if (left < ms)
+			ms = left;
+	}
+#ifdef LOCKBOARD
+	if (bs)
+		return board_wait(bs, seq, ms, flags, args);
+#else
+	(void)bs;
+	(void)seq;
+#endif
+#ifdef LOCKFILE_TEST
+	if (lockfile_test_sleep) {
+		lockfile_test_sleep(ms);
+		return 0;
+	}
+#endif
+#ifdef LIB
+	if (flags & __L_CANCELFD) {
+		pfd.fd = args->cancelfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, ms) > 0) {
+			errno = ECANCELED;
+			return L_CANCELLED;
+		}
+		return 0;
+	}
+	poll(NULL, 0, ms);
+	return 0;
+#else
+	return check_sleep(ms, flags);
+#endif
+}
+
+/*
+ *	Remove the temp lockfile and close the holder fd, if any.
+ *	Preserves errno and returns "r", so it can be used
+ *	directly in a return statement.
+ */
+static int tmplock_abort(char *tmplock, int holdfd, int r)
+{
+	int	e = errno;
+
+	if (tmplock[0])
+		(void)unlink(tmplock);
+	tmplock[0] = 0;
+	if (holdfd >= 0)
+		close(holdfd);
+	errno = e;
+	return r;
+}
+
+#ifdef __linux__
+/*
+ *	Start time of a process, in clock ticks since boot (field 22
+ *	of /proc/PID/stat). Together with the pid, that identifies a
+ *	process even if the pid gets reused. Returns 0 if unknown.
+ */
+static unsigned long long proc_starttime(pid_t pid)
+{
+	char			buf[512];
+	char			*p;
+	unsigned long long	start;
+	int			fd, len, i;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", (int)pid);
+	if ((fd = open(buf, O_RDONLY|O_CLOEXEC)) < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = 0;
+
+	/* the command name can contain anything, skip past it */
+	if ((p = strrchr(buf, ')')) == NULL)
+		return 0;
+	for (i = 0; i < 20; i++) {
+		if ((p = strchr(p + 1, ' ')) == NULL)
+			return 0;
+	}
+	start = strtoull(p + 1, NULL, 10);
+	return start;
+}
+
+/*
+ *	Identity of our pid namespace: pids in lockfiles written
+ *	from another namespace mean nothing here. 0 if unknown.
+ */
+static unsigned long pidns_id(void)
+{
+	static unsigned long	id;
+	struct stat		st;
+
+	if (id == 0 && stat("/proc/self/ns/pid", &st) == 0)
+		id = (unsigned long)st.st_ino;
+	return id;
+}
+#endif
+
+/*
+ *	What we know about a lockfile after reading it.
+ */
+struct lockinfo {
+	struct stat	st;		/* when it was read		*/
+	pid_t		pid;		/* 0 if none, or not asked for	*/
+	unsigned long long start;	/* start time of pid, or 0	*/
+	unsigned long	pidns;		/* pid namespace, or 0		*/
+	int		ofd;		/* kept alive by an OFD lock	*/
+	int		known;		/* the contents were read	*/
+};
+
+/*
+ *	Does "st" still look like the lockfile that "li" was read from?
+ */
+static int same_lock(const struct stat *st, const struct lockinfo *li)
+{
+	return li->known && st->st_dev == li->st.st_dev &&
+		st->st_ino == li->st.st_ino &&
+		st->st_size == li->st.st_size &&
+		st->st_mtime == li->st.st_mtime &&
+		st->st_ctime == li->st.st_ctime;
+}
+
+/*
+ *	Decide if a lockfile is valid from what was read from it
+ *	earlier. "now" is the time to hold the mtime against.
+ *	Returns 0 if so, -1 if not.
+ */
+static int judge_lock(struct lockinfo *li, time_t now)
+{
+	pid_t	pid = li->pid;
+	int	r;
+#ifdef __linux__
+	unsigned long long start;
+
+	/*
+	 *	A pid from another pid namespace (another container)
+	 *	can't be checked from here; go by the mtime instead.
+	 */
+	if (pid > 0 && li->pidns != 0 && pidns_id() != 0 &&
+	    li->pidns != pidns_id())
+		pid = 0;
+#endif
+
+	if (pid > 0) {
+		/*
+		 *	If we have a pid, see if the process
+		 *	owning the lockfile is still alive.
+		 */
+		r = kill(pid, 0);
+		if (r == 0 || errno == EPERM) {
+#ifdef __linux__
+			/*
+			 *	Same pid, but a different process that
+			 *	got the pid after the holder died?
+			 */
+			if (li->start != 0 &&
+			    (start = proc_starttime(pid)) != 0 &&
+			    start != li->start)
+				return -1;
+#endif
+			return 0;
+		}
+		if (r < 0 && errno == ESRCH)
+			return -1;
+		/* EINVAL - FALLTHRU */
+	}
+
+	/*
+	 *	Without a pid in the lockfile, the lock
+	 *	is valid if it is newer than 5 mins.
+	 */
+
+	if (now < li->st.st_mtime + 300)
+		return 0;
+
+	return -1;
+}
+
+/*
+ *	See if the lockfile that we have open on "fd" is valid.
+ *	"st" is its stat info, "fd" may be -1 if it can't be read.
+ *	What was read is left in "li", if not NULL.
+ *	Returns 0 if so, -1 if not.
+ */
+static int check_lock(int fd, struct stat *st, int flags, struct lockinfo *li)
+{
+	struct lockinfo	tmp;
+	struct stat	st2;
+	char		buf[128];
+	char		*p;
+	time_t		now;
+	int		len;
+#ifdef F_OFD_SETLK
+	int		r;
+#endif
+
+	if (li == NULL)
+		li = &tmp;
+	memset(li, 0, sizeof(*li));
+
+	/*
+	 *	Get the contents and mtime of the lockfile.
+	 */
+	time(&now);
+	if (fd >= 0) {
+		/*
+		 *	Try to use 'atime after read' as now, this is
+		 *	the time of the filesystem. Should not get
+		 *	confused by 'atime' or 'noatime' mount options.
+		 */
+		len = 0;
+		if (fstat(fd, st) == 0 &&
+		    (len = pread(fd, buf, sizeof(buf) - 1, 0)) >= 0 &&
+		    fstat(fd, &st2) == 0 &&
+		    st->st_atime != st2.st_atime)
+			now = st2.st_atime;
+		if (len < 0)
+			len = 0;
+		buf[len] = 0;
+		li->st = *st;
+		li->known = 1;
+#ifdef F_OFD_SETLK
+		/*
+		 *	If the holder keeps the lockfile open with an OFD
+		 *	lock, that tells us for sure if it's still alive.
+		 */
+		if (strstr(buf, "\n" LOCKOFDSTR "\n") != NULL &&
+		    (r = holder_alive(fd)) >= 0) {
+			li->ofd = 1;
+			return r ? 0 : -1;
+		}
+#endif
+		if (len > 0 && (flags & (L_PID|L_PPID)))
+			li->pid = atoi(buf);
+		if ((p = strstr(buf, "\n" LOCKSTARTSTR)) != NULL)
+			li->start = strtoull(p + 1 + strlen(LOCKSTARTSTR),
+					NULL, 10);
+		if ((p = strstr(buf, "\n" LOCKPIDNSSTR)) != NULL)
+			li->pidns = strtoul(p + 1 + strlen(LOCKPIDNSSTR),
+					NULL, 10);
+	} else
+		li->st = *st;
+
+	return judge_lock(li, now);
+}
+
+#if defined(LIB) || defined(LOCKSOCK)
+/*
+ *	Absolute name of a lockfile, so that other processes can
+ *	follow it whatever their working directory is.
+ */
+static int lock_abspath(const char *lockfile, char *buf, int bufsz)
+{
+	int	len;
+
+	if (lockfile[0] == '/') {
+		if ((int)strlen(lockfile) >= bufsz) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(buf, lockfile);
+		return 0;
+	}
+	if (getcwd(buf, bufsz) == NULL) {
+		if (errno == ERANGE)
+			errno = ENAMETOOLONG;
+		return -1;
+	}
+	len = strlen(buf);
+	if (len + 1 + (int)strlen(lockfile) >= bufsz) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	buf[len] = '/';
+	strcpy(buf + len + 1, lockfile);
+	return 0;
+}
+
+#endif
+
+#ifdef LIB
+/*
+ *	Locks this process holds that need something done when they
+ *	are removed or while we wait for another one: those taken
+ *	with L_WAITFOR or L_SYNCDIR, by absolute path.
+ */
+#define HELD_MAX	32
+#define HELD_PATHSZ	1024
+#define HELD_FLAGS	(__L_WAITFOR|__L_SYNCDIR)
+
+static char	held_path[HELD_MAX][HELD_PATHSZ];
+static int	held_flags[HELD_MAX];
+static int	nheld;
+static int	held_busy;
+
+/*
+ *	Index of "path" in the list of locks we hold, or -1.
+ *	Called with held_busy held.
+ */
+static int held_find(const char *path)
+{
+	int	i;
+
+	for (i = 0; i < nheld; i++)
+		if (strcmp(held_path[i], path) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ *	Deadlock detection (L_WAITFOR). While we wait for a lock, each
+ *	lock we hold gets a record "<lockfile>.wait" next to it, saying
+ *	who we are and which lock we are waiting for. Only the holder
+ *	of a lock writes its record, so starting from the lock that is
+ *	in our way we can follow the chain: holder, the lock it waits
+ *	for, its holder, and so on. If that leads back to a lock we
+ *	hold, there is a cycle. Everybody in it sees the same cycle,
+ *	and the one with the highest (host, pid) gives up.
+ */
+#define WF_DEPTH	16	/* longest chain that is followed	*/
+#define WF_PATHSZ	HELD_PATHSZ
+#define WF_HOSTSZ	256
+#define WF_SUFFIX	".wait"
+#define WF_RECSZ	(WF_PATHSZ + sizeof(WF_SUFFIX))
+
+static int	wf_published;
+
+/*
+ *	Who we are in the wait records: the pid we put in lockfiles.
+ */
+static void wf_self(int flags, pid_t *pid, char *host)
+{
+	*pid = (flags & L_PPID) ? getppid() : getpid();
+	if (gethostname(host, WF_HOSTSZ) < 0)
+		strcpy(host, "localhost");
+	host[WF_HOSTSZ - 1] = 0;
+}
+
+/*
+ *	Name of the wait record of a lock.
+ */
+static void wf_recname(char *buf, const char *lockfile)
+{
+	int	len = strnlen(lockfile, WF_PATHSZ - 1);
+
+	memcpy(buf, lockfile, len);
+	strcpy(buf + len, WF_SUFFIX);
+}
+
+/*
+ *	Read a small file into "buf".
+ */
+static int wf_readfile(const char *path, char *buf, int bufsz)
+{
+	int	fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	n = read(fd, buf, bufsz - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	return n;
+}
+
+/*
+ *	Publish that we wait for "waitfor", next to every lock we hold.
+ */
+static void wf_publish(const char *waitfor, int flags)
+{
+	char	path[WF_RECSZ];
+	char	host[WF_HOSTSZ];
+	char	buf[WF_PATHSZ + WF_HOSTSZ + 32];
+	pid_t	pid;
+	int	fd, i, len;
+
+	wf_self(flags, &pid, host);
+	len = snprintf(buf, sizeof(buf), "%d %s\n%s\n",
+			(int)pid, host, waitfor);
+	spin_lock(&held_busy);
+	for (i = 0; i < nheld; i++) {
+		if (!(held_flags[i] & __L_WAITFOR))
+			continue;
+		wf_recname(path, held_path[i]);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,
+				0644)) < 0)
+			continue;
+		(void)!write(fd, buf, len);
+		close(fd);
+	}
+	wf_published = 1;
+	spin_unlock(&held_busy);
+}
+
+/*
+ *	We're done waiting, one way or another: take the wait records
+ *	away again, and remember "lockfile" if we got it. Returns -1
+ *	if we got it but can't remember it (the list is full, or the
+ *	name too long): lockfile_remove() would skip what the flags
+ *	promise, so the caller must not keep the lock.
+ */
+static int held_done(const char *lockfile, int flags, int r)
+{
+	char	path[WF_RECSZ];
+	int	i, ret = 0;
+
+	spin_lock(&held_busy);
+	if (wf_published) {
+		for (i = 0; i < nheld; i++) {
+			if (!(held_flags[i] & __L_WAITFOR))
+				continue;
+			wf_recname(path, held_path[i]);
+			(void)unlink(path);
+		}
+		wf_published = 0;
+	}
+	if (r != L_SUCCESS)
+		;
+	else if (lock_abspath(lockfile, path, HELD_PATHSZ) < 0)
+		ret = -1;
+	else if (held_find(path) >= 0)
+		;
+	else if (nheld == HELD_MAX) {
+		errno = ENOLCK;
+		ret = -1;
+	} else {
+		strcpy(held_path[nheld], path);
+		held_flags[nheld++] = flags & HELD_FLAGS;
+	}
+	spin_unlock(&held_busy);
+	return ret;
+}
+
+/*
+ *	The lock is gone: forget about it, and about its wait record
+ *	in case we crashed earlier while waiting. Returns the flags
+ *	it was taken with, 0 if it isn't in the list.
+ */
+static int held_released(const char *lockfile)
+{
+	char	path[WF_RECSZ];
+	int	i, flags = 0;
+
+	if (__atomic_load_n(&nheld, __ATOMIC_RELAXED) == 0 ||
+	    lock_abspath(lockfile, path, HELD_PATHSZ) < 0)
+		return 0;
+	spin_lock(&held_busy);
+	if ((i = held_find(path)) >= 0) {
+		flags = held_flags[i];
+		if (i != --nheld) {
+			memcpy(held_path[i], held_path[nheld], HELD_PATHSZ);
+			held_flags[i] = held_flags[nheld];
+		}
+	}
+	spin_unlock(&held_busy);
+	if (flags & __L_WAITFOR) {
+		strcat(path, WF_SUFFIX);
+		(void)unlink(path);
+	}
+	return flags;
+}
+
+/*
+ *	We found "lockfile" held by somebody else. Publish what we're
+ *	waiting for and follow the chain of holders. Returns
+ *	L_DEADLOCK if we are in a cycle and must give up, 0 otherwise.
+ */
+static int wf_check(const char *lockfile, int flags)
+{
+	struct {
+		pid_t	pid;
+		char	host[WF_HOSTSZ];
+	}		who[WF_DEPTH + 1];
+	char		cur[WF_PATHSZ], rec[WF_PATHSZ + WF_HOSTSZ + 32];
+	char		path[WF_RECSZ];
+	char		*p, *q;
+	pid_t		holder;
+	int		n, d, c, held;
+
+	if (__atomic_load_n(&nheld, __ATOMIC_RELAXED) == 0 ||
+	    lock_abspath(lockfile, cur, sizeof(cur)) < 0)
+		return 0;
+	if (!__atomic_load_n(&wf_published, __ATOMIC_RELAXED))
+		wf_publish(cur, flags);
+	wf_self(flags, &who[0].pid, who[0].host);
+
+	for (n = 1, d = 0; d < WF_DEPTH; d++) {
+		/*
+		 *	Who holds "cur", and what is it waiting for? A
+		 *	record of an earlier holder has another pid.
+		 */
+		if (wf_readfile(cur, rec, sizeof(rec)) < 0 ||
+		    (holder = strtol(rec, NULL, 10)) <= 0)
+			return 0;
+		wf_recname(path, cur);
+		if (wf_readfile(path, rec, sizeof(rec)) < 0 ||
+		    (who[n].pid = strtol(rec, &p, 10)) != holder ||
+		    *p++ != ' ' || (q = strchr(p, '\n')) == NULL ||
+		    q - p >= WF_HOSTSZ)
+			return 0;
+		memcpy(who[n].host, p, q - p);
+		who[n].host[q - p] = 0;
+		p = q + 1;
+		if ((q = strchr(p, '\n')) == NULL || q - p >= WF_PATHSZ)
+			return 0;
+		*q = 0;
+		strcpy(cur, p);
+		n++;
+
+		/* ours, and still ours? */
+		spin_lock(&held_busy);
+		held = held_find(cur) >= 0;
+		spin_unlock(&held_busy);
+		if (held) {
+			if (wf_readfile(cur, rec, sizeof(rec)) < 0 ||
+			    strtol(rec, NULL, 10) != who[0].pid)
+				return 0;
+			break;
+		}
+	}
+	if (d == WF_DEPTH)
+		return 0;
+
+	/* a cycle: are we the victim? */
+	for (d = 1; d < n; d++) {
+		c = strcmp(who[d].host, who[0].host);
+		if (c > 0 || (c == 0 && who[d].pid >= who[0].pid))
+			return 0;
+	}
+	errno = EDEADLK;
+	return L_DEADLOCK;
+}
+#endif /* LIB */
+
+/*
+ *	L_PROBE: wait until the lockfile looks free or stale before
+ *	we create a temp file. Costs an open() and fstat() per try while
+ *	the lock is held; the lockfile is only read again when it
+ *	changed. Not stat(): over NFS that may answer from the attribute
+ *	cache, and then a new lockfile looks like the old one.
+ *	Returns the number of tries used, or an L_* error (negated).
+ *	"*sleeptime" and "bo" carry the backoff on to the link() loop.
+ */
+static int probe_lock(const char *lockfile, int tries, int flags,
+		struct __lockargs *args, int *sleeptime, struct backoff *bo)
+{
+	struct lockinfo	li;
+	struct stat	st;
+	struct board_slot *bs = NULL;
+	int		seq = 0;
+	int		fd, r, i;
+
+	memset(&li, 0, sizeof(li));
+#ifdef LOCKBOARD
+	if (flags & __L_BOARD)
+		bs = board_slot(lockfile, 1);
+#endif
+	for (i = 0; i < tries; i++) {
+		if (i > 0 && (r = retry_sleep(backoff_ms(bo, sleeptime, flags),
+				flags, args, bs, seq)) != 0)
+			return -r;
+		if (bs)
+			seq = __atomic_load_n(&bs->seq, __ATOMIC_SEQ_CST);
+		if ((fd = open(lockfile, O_RDONLY)) < 0) {
+			/* can't read it: only the mtime can tell */
+			if (errno != EACCES || lstat(lockfile, &st) < 0)
+				return i;
+		} else if (fstat(fd, &st) < 0) {
+			close(fd);
+			return i;
+		}
+		backoff_seen(bo, &st);
+
+		if (fd >= 0 && same_lock(&st, &li) && !li.ofd)
+			r = judge_lock(&li, time(NULL));
+		else
+			r = check_lock(fd, &st, flags, &li);
+		if (fd >= 0)
+			close(fd);
+		if (r < 0)
+			return i;
+#ifdef LIB
+		if ((flags & __L_WAITFOR) && (r = wf_check(lockfile, flags)) != 0)
+			return -r;
+#endif
+	}
+	errno = EAGAIN;
+	return -L_MAXTRYS;
+}
+
+/*
+ *	Remove the lockfile if it is stale. Several waiters can find
+ *	the same lockfile stale at the same time, and a slow one must
+ *	not remove the new lockfile that a faster one just created.
+ *	So we keep the stale file open (its inode number can't be
+ *	reused then), let only one process at a time remove it, and
+ *	only unlink the name if it still refers to that file. What
+ *	the name refers to is found out with a fresh open(): over NFS,
+ *	lstat() may answer from the attribute cache.
+ *	"fd" is the lockfile opened just now and "st" what fstat() said
+ *	about it, or -1 if it couldn't be opened; it is closed here.
+ *	"li" is what was read from it on an earlier call, if anything.
+ *	Returns 1 if the lockfile is gone, 0 if it's valid, -1 on error.
+ */
+static int remove_stale(const char *lockfile, int flags, int fd,
+		struct stat *st, struct lockinfo *li)
+{
+	struct stat	st2;
+	int		fd2, r;
+
+	if (fd < 0) {
+		/* can't read it: best effort, as before */
+		if (lockfile_check(lockfile, flags) == 0)
+			return 0;
+		return (unlink(lockfile) < 0 && errno != ENOENT) ? -1 : 1;
+	}
+
+	/*
+	 *	Same lockfile as last time? Then only the pid (or the
+	 *	age) is looked at again, not the contents. If it seems
+	 *	stale now, read it again to make sure before removing.
+	 *	A lock kept alive by an OFD lock needs the file open.
+	 */
+	if ((same_lock(st, li) && !li->ofd && judge_lock(li, time(NULL)) == 0) ||
+	    check_lock(fd, st, flags, li) == 0) {
+		close(fd);
+		return 0;
+	}
+	/*
+	 *	flock() works on a read-only fd, and doesn't get in
+	 *	the way of the fcntl() lock of an L_HOLDFD holder. If
+	 *	it's not supported, the inode check below still helps.
+	 */
+	if (flock(fd, LOCK_EX|LOCK_NB) < 0 && errno == EWOULDBLOCK) {
+		/* someone else is removing it right now */
+		close(fd);
+		return 1;
+	}
+	r = 1;
+	if ((fd2 = open(lockfile, O_RDONLY)) >= 0) {
+		if (fstat(fd2, &st2) == 0 &&
+		    st2.st_dev == st->st_dev && st2.st_ino == st->st_ino &&
+		    unlink(lockfile) < 0 && errno != ENOENT)
+			r = -1;
+		close(fd2);
+	}
+	close(fd);
+	return r;
+}
+
+/*
+ *	Decide which pid to write to the lockfile.
+ */
+static int lock_pid(int flags, pid_t *pid)
+{
+	*pid = 0;
+	if (flags & L_PID)
+		*pid = getpid();
+	if (flags & L_PPID) {
+		*pid = getppid();
+		if (*pid == 1) {
+			/* orphaned */
+			return L_ORPHANED;
+		}
+	}
+	return 0;
+}
+
+/*
+ *	What goes in a lockfile: the pid, and on Linux when it
+ *	started and in which pid namespace. Returns the length.
+ */
+static int lock_content(char *buf, int bufsz, pid_t pid)
+{
+#ifdef __linux__
+	unsigned long long start;
+#endif
+	int		len;
+
+	len = snprintf(buf, bufsz, "%d\n", pid);
+#ifdef __linux__
+	/* so that lockfile_check() can tell a reused or foreign pid */
+	if (pid > 0 && (start = proc_starttime(pid)) != 0)
+		len += snprintf(buf + len, bufsz - len,
+			"%s%llu\n", LOCKSTARTSTR, start);
+	if (pid > 0 && pidns_id() != 0)
+		len += snprintf(buf + len, bufsz - len,
+			"%s%lu\n", LOCKPIDNSSTR, pidns_id());
+#endif
+	return len;
+}
+
+/*
+ *	Create the temp lockfile (the name may have been precomputed)
+ *	and write the pid into it. With L_HOLDFD the fd is kept open,
+ *	OFD-locked, and returned in "*holdfd".
+ */
+static int write_tmplock(const char *lockfile, char *tmplock, int tmplocksz,
+		int flags, pid_t pid, int *holdfd)
+{
+	char		pidbuf[128];
+	int		fd, i, e, pidlen;
+
+	pidlen = (flags & __L_NOCONTENT) ? 0 :
+		lock_content(pidbuf, sizeof(pidbuf), pid);
+	if (pidlen > (int)sizeof(pidbuf) - 1) {
+		errno = EOVERFLOW;
+		return L_ERROR;
+	}
+
+	if (tmplock[0] == 0 &&
+	    (i = lockfilename(lockfile, tmplock, tmplocksz)) != 0)
+		return i;
+	for (i = 0; (fd = open(tmplock, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,
+			0644)) < 0; i++) {
+		/*
+		 *	Left over from an earlier try whose reply got
+		 *	lost (NFS), or in use by another thread: try
+		 *	the next name.
+		 */
+		if (errno != EEXIST || i == 15) {
+			tmplock[0] = 0;
+			return L_TMPLOCK;
+		}
+		tmp_nextname(tmplock);
+	}
+
+#ifdef F_OFD_SETLK
+	/*
+	 *	The lock is taken on the tempfile, before it is linked
+	 *	to the lockfile, so the lockfile is never visible unlocked.
+	 *	Old readers only look at the first line.
+	 */
+	if (flags & __L_HOLDFD) {
+		if ((i = holder_lock(fd)) < 0) {
+			close(fd);
+			return tmplock_abort(tmplock, -1, L_TMPLOCK);
+		}
+		if (i > 0) {
+			*holdfd = fd;
+			pidlen += snprintf(pidbuf + pidlen,
+				sizeof(pidbuf) - pidlen, "%s\n", LOCKOFDSTR);
+		}
+	}
+#endif
+	i = (pidlen > 0) ? write(fd, pidbuf, pidlen) : 0;
+	e = errno;
+	if (i == pidlen && (flags & __L_SYNC) && fsync(fd) < 0) {
+		e = errno;
+		i = -1;
+	}
+
+	if (*holdfd < 0 && close(fd) != 0) {
+		e = errno;
+		i = -1;
+	}
+	if (i != pidlen) {
+		errno = i < 0 ? e : EAGAIN;
+		i = tmplock_abort(tmplock, *holdfd, L_TMPWRITE);
+		*holdfd = -1;
+		return i;
+	}
+	return 0;
+}
+
+/*
+ *	Orphaned temp lockfiles. A locker that is killed between creating
+ *	its temp file and removing it again leaves .lk<pid><t><host>
+ *	behind, forever. While we wait for a lock anyway, we sweep some
+ *	of them up: at most once a minute per process, GC_SCAN directory
+ *	entries at a time, carrying on where the last run stopped.
+ */
+#define GC_INTERVAL	60
+#define GC_SCAN		256
+#define GC_LOCALAGE	60	/* and the process must be gone		*/
+#define GC_REMOTEAGE	3600	/* temp file of another host		*/
+#define GC_PATHSZ	4096
+
+/*
+ *	Is this the temp file of a process on this host that is gone,
+ *	or an old one of another host? The pid has at least 5 digits
+ *	and is followed by one hex digit (which may be a digit as well)
+ *	and the short hostname, cut off so that the whole name is at
+ *	most TMPLOCKFILENAMESZ - 1 characters. It is only ours if the
+ *	whole hostname is there: then its length tells where the pid
+ *	ends. A name that was cut off may be of a host whose name
+ *	starts like ours, so that one is treated as remote. A temp
+ *	file that is still linked to a lockfile is left alone.
+ */
+static int tmp_orphan(const char *name, const char *host,
+		const struct stat *st, time_t now)
+{
+	const char	*p = name + TMPLOCKSTRSZ;
+	pid_t		pid;
+	int		n, i, j;
+
+	if (strncmp(name, TMPLOCKSTR, TMPLOCKSTRSZ) != 0 ||
+	    !S_ISREG(st->st_mode) || st->st_nlink != 1)
+		return 0;
+	for (n = 0; p[n] >= '0' && p[n] <= '9'; n++)
+		;
+	if (n < TMPLOCKPIDSZ || !isxdigit((unsigned char)p[TMPLOCKPIDSZ]))
+		return 0;
+
+	i = (int)strlen(p) - (int)strlen(host) - 1;
+	if ((int)strlen(name) < (int)TMPLOCKFILENAMESZ - 1 &&
+	    i >= TMPLOCKPIDSZ && i <= n && isxdigit((unsigned char)p[i]) &&
+	    strcmp(p + i + 1, host) == 0) {
+		/* one of ours: is the process still there? */
+		if (now - st->st_mtime < GC_LOCALAGE)
+			return 0;
+		for (pid = 0, j = 0; j < i; j++)
+			pid = pid * 10 + (p[j] - '0');
+		return kill(pid, 0) < 0 && errno == ESRCH;
+	}
+	return now - st->st_mtime >= GC_REMOTEAGE;
+}
+
+/*
+ *	Right before removing temp file "name", look again: a locker of
+ *	another host whose clock is off can link it to the lockfile at
+ *	any time after the first look. It must still be the same file,
+ *	with one link, and not what "lockfile" (if known) refers to.
+ *	This narrows the window to the unlink() itself.
+ */
+static int tmp_unlinked(int dfd, const char *name, const struct stat *st,
+		const char *lockfile)
+{
+	struct stat	st1;
+
+	if (fstatat(dfd, name, &st1, AT_SYMLINK_NOFOLLOW) < 0 ||
+	    st1.st_dev != st->st_dev || st1.st_ino != st->st_ino ||
+	    st1.st_nlink != 1)
+		return 0;
+	if (lockfile && lstat(lockfile, &st1) == 0 &&
+	    st1.st_dev == st->st_dev && st1.st_ino == st->st_ino)
+		return 0;
+	return unlinkat(dfd, name, 0) == 0;
+}
+
+/*
+ *	Look at up to "scan" entries of directory "dir" (0: all of
+ *	them), after skipping the first "*pos", and remove the orphaned
+ *	temp files, except one that "lockfile" refers to. "*pos" is
+ *	where to go on next time, 0 at the end.
+ *	A telldir() position is only good for the stream it came from,
+ *	so we count entries from the start instead; skipping them costs
+ *	no more than the getdents() calls, no stat().
+ *	Returns the number of files removed, or -1.
+ */
+#ifdef LIB
+static
+#endif
+int tmp_sweep(const char *dir, const char *lockfile, int scan, long *pos)
+{
+	struct dirent	*de;
+	struct stat	st;
+	char		host[256], *p;
+	time_t		now = time(NULL);
+	DIR		*d;
+	long		skip = pos ? *pos : 0;
+	int		n = 0, removed = 0;
+
+	if (gethostname(host, sizeof(host)) < 0)
+		return -1;
+	host[sizeof(host) - 1] = 0;
+	if ((p = strchr(host, '.')) != NULL)
+		*p = 0;
+	if ((d = opendir(dir)) == NULL)
+		return -1;
+	while (skip > 0 && readdir(d) != NULL)
+		skip--;
+	while ((scan == 0 || n < scan) && (de = readdir(d)) != NULL) {
+		n++;
+		if (strncmp(de->d_name, TMPLOCKSTR, TMPLOCKSTRSZ) != 0 ||
+		    fstatat(dirfd(d), de->d_name, &st,
+				AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		if (tmp_orphan(de->d_name, host, &st, now) &&
+		    tmp_unlinked(dirfd(d), de->d_name, &st, lockfile))
+			removed++;
+	}
+	if (pos)
+		*pos = (scan && n == scan) ? *pos - skip + n : 0;
+	closedir(d);
+	return removed;
+}
+
+/*
+ *	The directory that "lockfile" is in.
+ */
+static int lock_dirname(const char *lockfile, char *dir, int dirsz)
+{
+	const char	*p;
+	int		len;
+
+	if ((p = strrchr(lockfile, '/')) == NULL)
+		strcpy(dir, ".");
+	else if (p == lockfile)
+		strcpy(dir, "/");
+	else if ((len = p - lockfile) < dirsz) {
+		memcpy(dir, lockfile, len);
+		dir[len] = 0;
+	} else {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *	L_SYNCDIR: make a new or removed name in the directory of
+ *	"lockfile" stable on disk.
+ */
+static int dir_sync(const char *lockfile)
+{
+	char	dir[GC_PATHSZ];
+	int	fd, r, e;
+
+	if (lock_dirname(lockfile, dir, sizeof(dir)) < 0 ||
+	    (fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0)
+		return -1;
+	r = fsync(fd);
+	e = errno;
+	close(fd);
+	errno = e;
+	return r;
+}
+
+/*
+ *	Run a bounded sweep of the directory of "lockfile", if it has
+ *	been a while. Only one thread at a time does this.
+ */
+static void tmp_gc(const char *lockfile)
+{
+	static time_t	last;
+	static long	pos;
+	static unsigned int dirhash;
+	char		dir[GC_PATHSZ];
+	unsigned int	h;
+	time_t		now = time(NULL), t;
+
+	t = __atomic_load_n(&last, __ATOMIC_RELAXED);
+	if (now - t < GC_INTERVAL || !__atomic_compare_exchange_n(&last,
+			&t, now, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	if (lock_dirname(lockfile, dir, sizeof(dir)) < 0)
+		return;
+
+	/* a position in another directory means nothing here */
+	if ((h = fnv_hash(dir)) != dirhash) {
+		dirhash = h;
+		pos = 0;
+	}
+	(void)tmp_sweep(dir, lockfile, GC_SCAN, &pos);
+}
+
+/*
+ *	Create a lockfile.
+ */
+static int lockfile_create_save_tmplock(const char *lockfile,
+		char *tmplock, int tmplocksz,
+		int retries, int flags, struct __lockargs *args)
+{
+	struct stat	st, st1;
+	struct lockinfo	li;
+	struct backoff	bo;
+	struct board_slot *bs = NULL;
+	char		nokeep[1];
+	char		*cleanup = tmplock;
+	pid_t		pid;
+	int		seq = 0;
+	int		sleeptime = 0;
+	int		statfailed = 0;
+	int		remade = 0;
+	int		holdfd = -1;
+	int		fd, got;
+	int		i, e;
+	int		dontsleep = 1;
+	int		tries = retries + 1;
+
+	/* process optional flags that have arguments */
+	if (flags & __L_INTERVAL) {
+		sleeptime = args->interval;
+	}
+	/* with a deadline, retries may be unlimited */
+	if ((flags & __L_DEADLINE) && retries < 0)
+		tries = INT_MAX;
+	if (flags & __L_HOLDFD)
+		args->fd = -1;
+
+	if ((i = lock_pid(flags, &pid)) != 0)
+		return i;
+
+	memset(&bo, 0, sizeof(bo));
+	memset(&li, 0, sizeof(li));
+#ifdef LIB
+	if (flags & __L_ADAPTIVE) {
+		bo.start = clock_ms(CLOCK_MONOTONIC);
+		if ((bo.est = ab_estimate(lockfile)) > 0)
+			bo.base = bo.step = bo.est / 4 > 10 ? bo.est / 4 : 10;
+	}
+#endif
+
+	/* don't create a temp file while the lock is obviously held */
+	if (flags & __L_PROBE) {
+		if ((i = probe_lock(lockfile, tries, flags, args,
+				&sleeptime, &bo)) < 0)
+			return -i;
+		tries -= i;
+		bo.waited = (i > 0);
+	}
+
+	if (flags & __L_KEEPTMP) {
+		/* the handle owns the temp file, see keep_tmplock() */
+		nokeep[0] = 0;
+		cleanup = nokeep;
+	} else if ((i = write_tmplock(lockfile, tmplock, tmplocksz,
+			flags, pid, &holdfd)) != 0) {
+		/* permission denied? perhaps try suid helper */
+#if defined(LIB) && defined(MAILGROUP)
+		if (i == L_TMPLOCK && errno == EACCES && is_maillock(lockfile))
+			return run_helper("-l", lockfile, retries, flags);
+#endif
+		return i;
+	}
+
+#ifdef LOCKBOARD
+	if (flags & __L_BOARD)
+		bs = board_slot(lockfile, 1);
+#endif
+
+	/*
+	 *	Now try to link the temporary lock to the lock.
+	 */
+	for (i = 0; i < tries && tries > 0; i++) {
+		if (!dontsleep) {
+			bo.waited = 1;
+			tmp_gc(lockfile);
+			if ((e = retry_sleep(backoff_ms(&bo, &sleeptime,
+					flags), flags, args, bs, seq)) != 0)
+				return tmplock_abort(cleanup, holdfd, e);
+		}
+		dontsleep = 0;
+		if (bs)
+			seq = __atomic_load_n(&bs->seq, __ATOMIC_SEQ_CST);
+
+
+		/*
+		 *	Now lock by linking the tempfile to the lock.
+		 *
+		 *	KLUDGE: some people say the return code of
+		 *	link() over NFS can't be trusted: a lost reply
+		 *	turns success into EEXIST. A success is real.
+		 *	EXTRA FIX: the value of the nlink field
+		 *	can't be trusted (may be cached), and neither
+		 *	can lstat() of the lockfile. Look at what the
+		 *	name refers to through a fresh open() instead.
+		 */
+		got = (link(tmplock, lockfile) == 0);
+
+		if (!got && lstat(tmplock, &st1) < 0) {
+			/*
+			 *	Swept up as an orphan by someone who
+			 *	couldn't tell we're alive - make it again.
+			 */
+			if (errno != ENOENT || remade++ >= 3)
+				return tmplock_abort(cleanup, holdfd, L_ERROR);
+			if (holdfd >= 0)
+				close(holdfd);
+			holdfd = -1;
+			if ((e = write_tmplock(lockfile, tmplock, tmplocksz,
+					flags, pid, &holdfd)) != 0)
+				return e;
+			dontsleep = 1;
+			if (i == tries - 1)
+				tries++;
+			continue;
+		}
+
+		fd = -1;
+		if (!got && ((fd = open(lockfile, O_RDONLY)) < 0 ?
+		    errno != EACCES || lstat(lockfile, &st) < 0 :
+		    fstat(fd, &st) < 0)) {
+			if (fd >= 0)
+				close(fd);
+			if (statfailed++ > 5) {
+				/*
+				 *	Normally, this can't happen; either
+				 *	another process holds the lockfile or
+				 *	we do. So if this error pops up
+				 *	repeatedly, just exit...
+				 */
+				return tmplock_abort(cleanup, holdfd, L_MAXTRYS);
+			}
+			continue;
+		}
+
+		/*
+		 *	See if we got the lock.
+		 */
+		if (got || (st.st_dev == st1.st_dev &&
+		    st.st_ino == st1.st_ino)) {
+			if (fd >= 0)
+				close(fd);
+			if (!(flags & __L_KEEPTMP)) {
+				(void)unlink(tmplock);
+				tmplock[0] = 0;
+			}
+			if ((flags & __L_SYNCDIR) && dir_sync(lockfile) < 0) {
+				e = errno;
+				(void)unlink(lockfile);
+				errno = e;
+				return tmplock_abort(cleanup, holdfd, L_ERROR);
+			}
+			if (flags & __L_HOLDFD)
+				args->fd = holdfd;
+#ifdef LIB
+			if (flags & __L_ADAPTIVE)
+				ab_acquired(lockfile, &bo);
+#endif
+			return L_SUCCESS;
+		}
+		statfailed = 0;
+		backoff_seen(&bo, &st);
+
+		/*
+		 *	If there is a lockfile and it is invalid,
+		 *	remove the lockfile.
+		 */
+		if ((e = remove_stale(lockfile, flags, fd, &st, &li)) != 0) {
+			if (e < 0) {
+				/*
+				 *	we failed to unlink the stale
+				 *	lockfile, give up.
+				 */
+				return tmplock_abort(cleanup, holdfd, L_RMSTALE);
+			}
+			dontsleep = 1;
+			/*
+			 *	If the lockfile was invalid, then the first
+			 *	try wasn't valid either - make sure we
+			 *	try at least once more.
+			 */
+			if (tries == 1) tries++;
+		}
+#ifdef LIB
+		else if ((flags & __L_WAITFOR) &&
+			 (e = wf_check(lockfile, flags)) != 0)
+			return tmplock_abort(cleanup, holdfd, e);
+#endif
+
+	}
+	errno = EAGAIN;
+	return tmplock_abort(cleanup, holdfd, L_MAXTRYS);
+}
+
+#ifdef LOCKTABLE
+/*
+ *	In-process lock table (L_THREAD). Threads of one process that
+ *	lock the same path sort it out among themselves on a futex,
+ *	and only the thread that wins goes to the filesystem. When the
+ *	owner removes the lock while other threads are waiting, the
+ *	lockfile is left in place and handed to the next one.
+ *
+ *	Slots are claimed and shared with atomic ops on "refs": -1
+ *	while a slot is being set up or torn down, otherwise the number
+ *	of threads using it. Two threads may race and claim a slot each
+ *	for the same path; that's harmless, the lockfile decides.
+ */
+#define LT_SLOTS	64
+#define LT_PATHSZ	512
+
+struct lt_slot {
+	int		refs;		/* threads using this slot	*/
+	int		mutex;		/* 0 free, 1 locked, 2 waiters	*/
+	int		fsheld;		/* the lockfile is ours		*/
+	pid_t		owner;		/* thread id of the holder	*/
+	int		depth;		/* recursion depth		*/
+	unsigned int	hash;
+	char		path[LT_PATHSZ];
+};
+
+static struct lt_slot	lt_table[LT_SLOTS];
+static int		lt_inuse;
+
+static void lt_unlock(struct lt_slot *s)
+{
+	if (__atomic_exchange_n(&s->mutex, 0, __ATOMIC_SEQ_CST) == 2)
+		futex(&s->mutex, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
+
+/*
+ *	Drop a reference. The last one out removes the lockfile
+ *	if it is still ours, and frees the slot.
+ */
+static int lt_put(struct lt_slot *s)
+{
+	int	r, n, ret = 0;
+
+	r = __atomic_load_n(&s->refs, __ATOMIC_SEQ_CST);
+	do {
+		n = (r == 1) ? -1 : r - 1;
+	} while (!__atomic_compare_exchange_n(&s->refs, &r, n, 0,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	if (n != -1)
+		return 0;
+	if (s->fsheld)
+		ret = lockfile_remove(s->path);
+	s->fsheld = 0;
+	s->hash = 0;
+	__atomic_sub_fetch(&lt_inuse, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&s->refs, 0, __ATOMIC_SEQ_CST);
+	return ret;
+}
+
+/*
+ *	Find the slot for "path" and take a reference. If there
+ *	is none and "create" is set, claim a free one. Returns
+ *	NULL if the path is too long or the table is full.
+ */
+static struct lt_slot *lt_get(const char *path, int create)
+{
+	struct lt_slot	*s;
+	unsigned int	h;
+	int		i, r;
+
+	if (strlen(path) >= LT_PATHSZ)
+		return NULL;
+	h = fnv_hash(path);
+	for (i = 0; i < LT_SLOTS; i++) {
+		s = &lt_table[(h + i) % LT_SLOTS];
+		r = __atomic_load_n(&s->refs, __ATOMIC_SEQ_CST);
+		while (r > 0 && s->hash == h) {
+			if (!__atomic_compare_exchange_n(&s->refs, &r, r + 1,
+					0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				continue;
+			/* might have been reused in the meantime */
+			if (s->hash == h && strcmp(s->path, path) == 0)
+				return s;
+			lt_put(s);
+			break;
+		}
+	}
+	if (!create)
+		return NULL;
+	for (i = 0; i < LT_SLOTS; i++) {
+		s = &lt_table[(h + i) % LT_SLOTS];
+		r = 0;
+		if (!__atomic_compare_exchange_n(&s->refs, &r, -1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			continue;
+		strcpy(s->path, path);
+		s->hash = h;
+		s->mutex = 0;
+		s->fsheld = 0;
+		s->owner = 0;
+		s->depth = 0;
+		__atomic_add_fetch(&lt_inuse, 1, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&s->refs, 1, __ATOMIC_SEQ_CST);
+		return s;
+	}
+	return NULL;
+}
+
+/*
+ *	Take the in-process mutex of a slot. Waits as long as the
+ *	filesystem loop would have for the same "retries", flags
+ *	and deadline, but on the futex instead of polling the
+ *	lockfile. "*used" is set to the number of retries spent.
+ */
+static int lt_lock(struct lt_slot *s, int retries, int flags,
+		struct __lockargs *args, int *used)
+{
+	struct timespec	ts, end;
+	struct pollfd	pfd;
+	int		sleeptime = 0;
+	int		tries = retries + 1;
+	long		left;
+	int		i, c;
+
+	if (flags & __L_INTERVAL)
+		sleeptime = args->interval;
+	if ((flags & __L_DEADLINE) && retries < 0)
+		tries = INT_MAX;
+
+	for (i = 0; i < tries; i++) {
+		if (i == 0) {
+			c = 0;
+			if (__atomic_compare_exchange_n(&s->mutex, &c, 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				break;
+			continue;
+		}
+		if (!(flags & __L_INTERVAL))
+			sleeptime += 5;
+		if (sleeptime > 60) sleeptime = 60;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		end.tv_sec += sleeptime;
+		if ((flags & __L_DEADLINE) &&
+		    (end.tv_sec > args->deadline.tv_sec ||
+		     (end.tv_sec == args->deadline.tv_sec &&
+		      end.tv_nsec > args->deadline.tv_nsec)))
+			end = args->deadline;
+
+		c = __atomic_exchange_n(&s->mutex, 2, __ATOMIC_SEQ_CST);
+		while (c != 0 && (left = deadline_left(&end)) > 0) {
+			if (flags & __L_CANCELFD) {
+				pfd.fd = args->cancelfd;
+				pfd.events = POLLIN;
+				if (poll(&pfd, 1, 0) > 0) {
+					errno = ECANCELED;
+					return L_CANCELLED;
+				}
+				/* look at the cancel fd now and then */
+				if (left > 100)
+					left = 100;
+			}
+			ts.tv_sec = left / 1000;
+			ts.tv_nsec = (left % 1000) * 1000000L;
+			futex(&s->mutex, FUTEX_WAIT_PRIVATE, 2, &ts);
+			c = __atomic_exchange_n(&s->mutex, 2, __ATOMIC_SEQ_CST);
+		}
+		if (c == 0)
+			break;
+		if ((flags & __L_DEADLINE) &&
+		    deadline_left(&args->deadline) <= 0) {
+			errno = ETIMEDOUT;
+			return L_TIMEOUT;
+		}
+	}
+	if (i == tries) {
+		errno = EAGAIN;
+		return L_MAXTRYS;
+	}
+	*used = i;
+	return 0;
+}
+
+/*
+ *	lockfile_create() through the lock table.
+ */
+static int lt_acquire(const char *lockfile, char *tmplock, int tmplocksz,
+		int retries, int flags, struct __lockargs *args)
+{
+	struct lt_slot	*s;
+	pid_t		me;
+	int		r, e, used = 0;
+
+	/* the holder fd would stay with the first thread */
+	if (flags & __L_HOLDFD) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	if ((s = lt_get(lockfile, 1)) == NULL)
+		return lockfile_create_save_tmplock(lockfile, tmplock,
+				tmplocksz, retries, flags, args);
+
+	me = (pid_t)syscall(SYS_gettid);
+	if (__atomic_load_n(&s->owner, __ATOMIC_SEQ_CST) == me) {
+		if (flags & __L_RECURSIVE) {
+			s->depth++;
+			lt_put(s);
+			return L_SUCCESS;
+		}
+		lt_put(s);
+		errno = EDEADLK;
+		return L_ERROR;
+	}
+
+	if ((r = lt_lock(s, retries, flags, args, &used)) != 0) {
+		e = errno;
+		lt_put(s);
+		errno = e;
+		return r;
+	}
+	/* if the lockfile was handed to us, we're done */
+	if (!s->fsheld) {
+		if (retries >= 0)
+			retries = retries > used ? retries - used : 0;
+		r = lockfile_create_save_tmplock(lockfile, tmplock,
+				tmplocksz, retries, flags, args);
+		if (r != L_SUCCESS) {
+			e = errno;
+			lt_unlock(s);
+			lt_put(s);
+			errno = e;
+			return r;
+		}
+		s->fsheld = 1;
+	}
+	s->depth = 1;
+	__atomic_store_n(&s->owner, me, __ATOMIC_SEQ_CST);
+
+	/* the reference is dropped by lockfile_remove() */
+	return L_SUCCESS;
+}
+
+/*
+ *	lockfile_remove() of a lock that's held through the table.
+ *	Returns 1 if the path isn't, and should just be unlinked.
+ */
+static int lt_release(const char *lockfile, int *ret)
+{
+	struct lt_slot	*s;
+
+	if (__atomic_load_n(&lt_inuse, __ATOMIC_SEQ_CST) == 0 ||
+	    (s = lt_get(lockfile, 0)) == NULL)
+		return 1;
+	if (__atomic_load_n(&s->owner, __ATOMIC_SEQ_CST) == 0) {
+		lt_put(s);
+		return 1;
+	}
+	*ret = 0;
+	if (--s->depth > 0) {
+		lt_put(s);
+		return 0;
+	}
+	/*
+	 *	Let go of the mutex but not of the lockfile: if a
+	 *	thread is waiting it takes over the lockfile as it is,
+	 *	otherwise the last reference removes it.
+	 */
+	__atomic_store_n(&s->owner, 0, __ATOMIC_SEQ_CST);
+	lt_unlock(s);
+	lt_put(s);
+	*ret = lt_put(s);
+	return 0;
+}
+#endif /* LOCKTABLE */
+
+#ifdef LOCKSOCK
+/*
+ *	Host-local locks on an abstract Unix socket (L_ABSTRACT). The
+ *	lock is held by whoever has the socket bound to the name; the
+ *	kernel releases it when the last fd is closed, also when the
+ *	holder dies, so there are no files and no stale locks. The
+ *	holder listens, so that waiters can queue a connection on it
+ *	and get a hangup the moment it goes away.
+ */
+#define SOCK_PREFIX	"liblockfile:"
+#define SOCK_MAX	32
+
+struct sock_lock {
+	int		fd;
+	int		handoffs;	/* L_LOCAL: times handed on, or -1 */
+	int		flags;
+};
+
+static struct {
+	struct sock_lock l;
+	char		name[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} sock_table[SOCK_MAX];
+static int		sock_inuse;
+static int		sock_busy;
+
+/*
+ *	Socket address for "lockfile": the prefix and its absolute
+ *	name, so that a relative name means the same lock whatever
+ *	the working directory is.
+ */
+static int sock_name(const char *prefix, const char *lockfile,
+		struct sockaddr_un *sa, socklen_t *len)
+{
+	char	path[sizeof(sa->sun_path)];
+	int	n;
+
+	if (lock_abspath(lockfile, path, sizeof(path)) < 0) {
+		errno = ENAMETOOLONG;
+		return L_NAMELEN;
+	}
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	n = snprintf(sa->sun_path + 1, sizeof(sa->sun_path) - 1, "%s%s",
+		prefix, path);
+	if (n < 0 || n >= (int)sizeof(sa->sun_path) - 1) {
+		errno = ENAMETOOLONG;
+		return L_NAMELEN;
+	}
+	*len = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+	return 0;
+}
+
+/*
+ *	Remember (l->fd >= 0) or forget (l->fd < 0) the socket that
+ *	holds "lockfile"; what is forgotten is returned in "*l".
+ *	Returns the fd that was remembered or forgotten, or -1.
+ */
+static int sock_register(const char *lockfile, struct sock_lock *l)
+{
+	int	i, r = -1;
+
+	if (strlen(lockfile) >= sizeof(sock_table[0].name)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	spin_lock(&sock_busy);
+	for (i = 0; i < SOCK_MAX; i++) {
+		if (l->fd >= 0 && sock_table[i].name[0] == 0) {
+			strcpy(sock_table[i].name, lockfile);
+			sock_table[i].l = *l;
+			__atomic_add_fetch(&sock_inuse, 1, __ATOMIC_SEQ_CST);
+			r = l->fd;
+			break;
+		}
+		if (l->fd < 0 && strcmp(sock_table[i].name, lockfile) == 0) {
+			sock_table[i].name[0] = 0;
+			__atomic_sub_fetch(&sock_inuse, 1, __ATOMIC_SEQ_CST);
+			*l = sock_table[i].l;
+			r = l->fd;
+			break;
+		}
+	}
+	spin_unlock(&sock_busy);
+	return r;
+}
+
+/*
+ *	Is the lock held? Connecting tells us without disturbing
+ *	anyone that tries to bind the name at the same time. Returns
+ *	0 if the connection was queued, with the connected fd in
+ *	"*fdp", 1 if the lock is held but the queue is full, and -1
+ *	if it isn't held.
+ */
+static int sock_probe(const struct sockaddr_un *sa, socklen_t len, int *fdp)
+{
+	int	fd, r;
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return 1;
+	if (connect(fd, (const struct sockaddr *)sa, len) == 0) {
+		*fdp = fd;
+		return 0;
+	}
+	r = (errno == EAGAIN) ? 1 : -1;
+	close(fd);
+	return r;
+}
+
+/*
+ *	Take the socket that a holder passed on to us (L_LOCAL), if
+ *	there is one. Returns it, and how often the lock was handed on
+ *	before in "*handoffs", or -1. The holder puts our pid in the
+ *	lockfile after sending, and hangs up when it is done; only
+ *	then is the lockfile ours to remove.
+ */
+static int sock_recvfd(int fd, int *handoffs)
+{
+	char		cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr	msg;
+	struct iovec	iov;
+	struct cmsghdr	*cm;
+	struct pollfd	pfd;
+	int		lfd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = handoffs;
+	iov.iov_len = sizeof(*handoffs);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(fd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC) !=
+			sizeof(*handoffs) ||
+	    (cm = CMSG_FIRSTHDR(&msg)) == NULL ||
+	    cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(&lfd, CMSG_DATA(cm), sizeof(lfd));
+
+	/* no events: wait for POLLHUP, which comes even after SHUT_RD */
+	pfd.fd = fd;
+	pfd.events = 0;
+	while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+		;
+	return lfd;
+}
+
+/*
+ *	Stop waiting in the queue of the holder on "*qfd". With
+ *	"handoff" (L_LOCAL) a socket that was passed on to us just
+ *	before is still taken; the holder can't send us anything
+ *	after the shutdown, so it is either here now or never comes.
+ */
+static void sock_dequeue(int *qfd, int *handoff, int *handoffs)
+{
+	if (*qfd < 0)
+		return;
+	if (handoff) {
+		shutdown(*qfd, SHUT_RD);
+		*handoff = sock_recvfd(*qfd, handoffs);
+	}
+	close(*qfd);
+	*qfd = -1;
+}
+
+/*
+ *	Wait "ms" for the holder to go away. We queue a connection on
+ *	its socket and keep it in "*qfd" from one wait to the next, so
+ *	that a waiter is only in the queue once: nobody accepts it, and
+ *	it only goes away with the holder. Returns 0 with "*qfd" closed
+ *	when the holder is gone (or was never there). With "handoff"
+ *	(L_LOCAL) the holder may pass its socket on to us instead; then
+ *	that is returned in "*handoff" and the count in "*handoffs".
+ */
+static int sock_wait(const struct sockaddr_un *sa, socklen_t len, long ms,
+		int flags, struct __lockargs *args, int *qfd,
+		int *handoff, int *handoffs)
+{
+	struct pollfd	pfd[2];
+	long		left;
+	int		n = 1, r;
+
+	if (flags & __L_DEADLINE) {
+		if ((left = deadline_left(&args->deadline)) <= 0) {
+			errno = ETIMEDOUT;
+			return L_TIMEOUT;
+		}
+		if (left < ms)
+			ms = left;
+	}
+	if (*qfd < 0 && (r = sock_probe(sa, len, qfd)) != 0)
+		return (r < 0) ? 0 : retry_sleep(ms, flags, args, NULL, 0);
+
+	/* closing the socket hangs up on us, a handoff arrives as data */
+	pfd[0].fd = *qfd;
+	pfd[0].events = POLLIN;
+	if (flags & __L_CANCELFD) {
+		pfd[1].fd = args->cancelfd;
+		pfd[1].events = POLLIN;
+		n = 2;
+	}
+	r = poll(pfd, n, ms);
+	if (r > 0 && n == 2 && pfd[1].revents) {
+		sock_dequeue(qfd, handoff, handoffs);
+		if (handoff && *handoff >= 0)
+			return 0;
+		errno = ECANCELED;
+		return L_CANCELLED;
+	}
+	if (r > 0 && pfd[0].revents) {
+		if (handoff)
+			*handoff = sock_recvfd(*qfd, handoffs);
+		close(*qfd);
+		*qfd = -1;
+	}
+	return 0;
+}
+
+/*
+ *	Bind and listen on "sa", waiting for the holder in between.
+ *	The socket is returned in "l->fd". With "local" a holder may
+ *	pass its socket on to us; then "l->handoffs" is set. The
+ *	retries we waited are taken off "*retries".
+ */
+static int sock_bind(const struct sockaddr_un *sa, socklen_t len,
+		int *retries, int flags, struct __lockargs *args, int local,
+		struct sock_lock *l)
+{
+	struct backoff	bo;
+	int		sleeptime = 0;
+	int		tries = *retries + 1;
+	int		qfd = -1;
+	int		fd, i, e = 0, err;
+
+	if (flags & __L_INTERVAL)
+		sleeptime = args->interval;
+	if ((flags & __L_DEADLINE) && *retries < 0)
+		tries = INT_MAX;
+	memset(&bo, 0, sizeof(bo));
+	l->fd = -1;
+	l->handoffs = -1;
+
+	for (i = 0; i < tries; i++) {
+		if (i > 0 && *retries > 0)
+			(*retries)--;
+		if (i > 0 && (e = sock_wait(sa, len,
+				backoff_ms(&bo, &sleeptime, flags), flags, args,
+				&qfd, local ? &l->fd : NULL, &l->handoffs)) != 0)
+			break;
+		if (local && l->fd >= 0)
+			return L_SUCCESS;
+		/* still in the queue: the holder is still there */
+		if (qfd >= 0)
+			continue;
+		fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|
+				(local ? SOCK_NONBLOCK : 0), 0);
+		if (fd < 0)
+			return L_ERROR;
+		if (bind(fd, (const struct sockaddr *)sa, len) == 0) {
+			if (listen(fd, SOMAXCONN) < 0) {
+				e = errno;
+				close(fd);
+				errno = e;
+				return L_ERROR;
+			}
+			l->fd = fd;
+			return L_SUCCESS;
+		}
+		e = errno;
+		close(fd);
+		if (e != EADDRINUSE) {
+			errno = e;
+			return L_ERROR;
+		}
+	}
+	if (i == tries) {
+		e = L_MAXTRYS;
+		errno = EAGAIN;
+	}
+	err = errno;
+	sock_dequeue(&qfd, local ? &l->fd : NULL, &l->handoffs);
+	if (local && l->fd >= 0)
+		return L_SUCCESS;
+	errno = err;
+	return e;
+}
+
+static int sock_acquire(const char *lockfile, int retries, int flags,
+		struct __lockargs *args)
+{
+	struct sockaddr_un	sa;
+	struct sock_lock	l;
+	socklen_t		len;
+	int			e;
+
+	if (flags & (__L_THREAD|__L_HOLDFD|__L_KEEPTMP|__L_LOCAL)) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	if ((e = sock_name(SOCK_PREFIX, lockfile, &sa, &len)) != 0)
+		return e;
+	if ((e = sock_bind(&sa, len, &retries, flags, args, 0, &l)) != 0)
+		return e;
+	l.flags = flags;
+	if (sock_register(lockfile, &l) < 0) {
+		e = (errno == 0) ? ENFILE : errno;
+		close(l.fd);
+		errno = e;
+		return L_ERROR;
+	}
+	if (args)
+		args->fd = l.fd;
+	return L_SUCCESS;
+}
+
+/*
+ *	lockfile_check() of an abstract lock. Not by connecting: the
+ *	holder never accepts, so every check would stay in its queue
+ *	until it lets go. The name is bound, if it is free, for as
+ *	long as it takes to close the socket again.
+ */
+static int sock_check(const char *lockfile)
+{
+	struct sockaddr_un	sa;
+	socklen_t		len;
+	int			fd, r;
+
+	if (sock_name(SOCK_PREFIX, lockfile, &sa, &len) != 0 ||
+	    (fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	r = (bind(fd, (const struct sockaddr *)&sa, len) < 0 &&
+	     errno == EADDRINUSE) ? 0 : -1;
+	close(fd);
+	return r;
+}
+
+#ifdef LIB
+/*
+ *	Host-local aggregation (L_LOCAL). Waiters on one host first
+ *	queue on an abstract socket named after the lockfile, and only
+ *	the one that binds it goes on to the lockfile itself. When it
+ *	is done, it leaves the lockfile in place and passes the socket
+ *	on to the next local waiter, rewriting the lockfile with that
+ *	one's pid first. After LOCAL_HANDOFFS of those the lockfile is
+ *	removed, so that other hosts get a turn. The filesystem sees
+ *	one locker per host, not one per process.
+ */
+#define LOCAL_PREFIX	"liblockfile-local:"
+#define LOCAL_HANDOFFS	8
+#define LOCAL_NOT	(L_PPID|__L_HOLDFD|__L_THREAD|__L_KEEPTMP|__L_BOARD|\
+			 __L_WAITFOR|__L_SYNCDIR)
+
+static int local_acquire(const char *lockfile, char *tmplock, int tmplocksz,
+		int retries, int flags, struct __lockargs *args)
+{
+	struct sockaddr_un	sa;
+	struct sock_lock	l;
+	socklen_t		len;
+	int			c, e;
+
+	if (flags & LOCAL_NOT) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	flags &= ~__L_LOCAL;
+	if (strlen(lockfile) >= sizeof(sock_table[0].name) ||
+	    sock_name(LOCAL_PREFIX, lockfile, &sa, &len) != 0)
+		/* can't be shared on this host: everybody for themselves */
+		return lockfile_create_save_tmplock(lockfile, tmplock,
+				tmplocksz, retries, flags, args);
+
+	if ((e = sock_bind(&sa, len, &retries, flags, args, 1, &l)) != 0)
+		return e;
+	/* only what sock_bind() left of "retries" for the lockfile */
+	if (l.handoffs < 0) {
+		e = lockfile_create_save_tmplock(lockfile, tmplock,
+				tmplocksz, retries, flags, args);
+		if (e != L_SUCCESS) {
+			c = errno;
+			close(l.fd);
+			errno = c;
+			return e;
+		}
+		l.handoffs = 0;
+	}
+	l.flags = flags;
+	if (sock_register(lockfile, &l) < 0) {
+		e = (errno == 0) ? ENFILE : errno;
+		unlink(lockfile);
+		close(l.fd);
+		errno = e;
+		return L_ERROR;
+	}
+	return L_SUCCESS;
+}
+
+/*
+ *	Hand the lock to the waiter on the other end of "c": it gets
+ *	our socket, and the lockfile gets its pid. The new lockfile is
+ *	written aside and renamed over the old one, so that a reader
+ *	never sees it empty or half written, but only once the socket
+ *	is on its way: a waiter that has gone must not be left behind
+ *	in the lockfile, which would then look stale while the next
+ *	waiter holds the lock. Until the rename the lockfile still has
+ *	our pid, and we're alive: the waiter doesn't go on before we
+ *	hang up (see sock_recvfd()).
+ */
+static int local_handoff(const char *lockfile, const struct sock_lock *l,
+		int c)
+{
+	char		tmplock[sizeof(sock_table[0].name) + TMPLOCKFILENAMESZ];
+	char		cbuf[CMSG_SPACE(sizeof(int))];
+	struct ucred	cr;
+	socklen_t	crlen = sizeof(cr);
+	struct msghdr	msg;
+	struct iovec	iov;
+	struct cmsghdr	*cm;
+	int		n = l->handoffs + 1;
+	int		holdfd = -1;
+
+	if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cr, &crlen) < 0)
+		return -1;
+	tmplock[0] = 0;
+	if (write_tmplock(lockfile, tmplock, sizeof(tmplock), l->flags,
+			(l->flags & L_PID) ? cr.pid : 0, &holdfd) != 0)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &n;
+	iov.iov_len = sizeof(n);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &l->fd, sizeof(int));
+	if (sendmsg(c, &msg, MSG_DONTWAIT|MSG_NOSIGNAL) != sizeof(n))
+		return tmplock_abort(tmplock, -1, -1);
+
+	/* it has the lock now, and waits until we hang up */
+	if (rename(tmplock, lockfile) < 0)
+		(void)tmplock_abort(tmplock, -1, 0);
+	return 0;
+}
+
+/*
+ *	lockfile_remove() of an L_LOCAL lock. A waiter that gave up
+ *	has shut its end down, then we try the next one.
+ */
+static int local_release(const char *lockfile, struct sock_lock *l)
+{
+	int	c, r, e;
+
+	if (l->handoffs < LOCAL_HANDOFFS) {
+		while ((c = accept4(l->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+			r = local_handoff(lockfile, l, c);
+			close(c);
+			if (r == 0) {
+				close(l->fd);
+				return 0;
+			}
+		}
+	}
+	r = (unlink(lockfile) < 0 && errno != ENOENT) ? -1 : 0;
+	e = errno;
+	ab_released(lockfile);
+	close(l->fd);
+	errno = e;
+	return r;
+}
+#endif /* LIB */
+
+/*
+ *	lockfile_remove() of an abstract lock we hold.
+ *	Returns 1 if "lockfile" isn't one.
+ */
+static int sock_release(const char *lockfile)
+{
+	struct sock_lock	l;
+
+	l.fd = -1;
+	if (__atomic_load_n(&sock_inuse, __ATOMIC_SEQ_CST) == 0 ||
+	    sock_register(lockfile, &l) < 0)
+		return 1;
+#ifdef LIB
+	if (l.handoffs >= 0)
+		return local_release(lockfile, &l);
+#endif
+	return close(l.fd);
+}
+#endif /* LOCKSOCK */
+
+/*
+ *	Create a lockfile, through the in-process lock table if
+ *	L_THREAD is set or after the other waiters on this host if
+ *	L_LOCAL is, or take an abstract lock.
+ */
+static int lockfile_create_tmplock(const char *lockfile,
+		char *tmplock, int tmplocksz,
+		int retries, int flags, struct __lockargs *args)
+{
+	int	r;
+#ifdef LIB
+	int	e;
+#endif
+
+	if (flags & __L_ABSTRACT) {
+#ifdef LOCKSOCK
+		return sock_acquire(lockfile, retries, flags, args);
+#else
+		errno = ENOSYS;
+		return L_ERROR;
+#endif
+	}
+#if defined(LOCKSOCK) && defined(LIB)
+	if (flags & __L_LOCAL)
+		r = local_acquire(lockfile, tmplock, tmplocksz,
+				retries, flags, args);
+	else
+#endif
+#ifdef LOCKTABLE
+	if (flags & __L_THREAD)
+		r = lt_acquire(lockfile, tmplock, tmplocksz,
+				retries, flags, args);
+	else
+#endif
+	r = lockfile_create_save_tmplock(lockfile, tmplock, tmplocksz,
+			retries, flags, args);
+#ifdef LIB
+	if ((flags & HELD_FLAGS) && held_done(lockfile, flags, r) < 0) {
+		e = errno;
+		(void)lockfile_remove(lockfile);
+		if ((flags & __L_HOLDFD) && args->fd >= 0) {
+			close(args->fd);
+			args->fd = -1;
+		}
+		errno = e;
+		r = L_ERROR;
+	}
+#endif
+	return r;
+}
+
+/*
+ *	Flags that lockfile_create2() and the handle functions accept.
+ */
+#define FLAGS_WITH_ARGS (__L_INTERVAL|__L_HOLDFD|__L_DEADLINE|__L_CANCELFD)
+#define KNOWN_FLAGS (L_PID|L_PPID|FLAGS_WITH_ARGS|__L_THREAD|__L_RECURSIVE|\
+		__L_PROBE|__L_KEEPTMP|__L_BOARD|__L_ADAPTIVE|__L_ABSTRACT|\
+		__L_WAITFOR|__L_LOCAL|__L_NOCONTENT|__L_SYNC|__L_SYNCDIR)
+
+/*
+ *	L_NOCONTENT leaves no pid or OFD marker to check, and with
+ *	L_THREAD a lockfile can be handed on and removed by another
+ *	thread, without the directory being synced.
+ */
+static int durability_bad(int flags)
+{
+	return ((flags & __L_NOCONTENT) &&
+		(flags & (L_PID|L_PPID|__L_HOLDFD))) ||
+	       ((flags & __L_SYNCDIR) && (flags & __L_THREAD));
+}
+
+/*
+ *	Handles with L_KEEPTMP that have a temp file, so that it
+ *	can be removed at exit.
+ */
+static struct lockfile_handle	*keep_list;
+static int			keep_busy;
+static int			keep_atexit;
+
+static void keep_cleanup(void)
+{
+	struct lockfile_handle	*h;
+	pid_t			me = getpid();
+
+	for (h = keep_list; h; h = h->next)
+		if (h->tmpowner == me && h->tmplock[0])
+			unlink(h->tmplock);
+}
+
+static void keep_register(struct lockfile_handle *h, int add)
+{
+	struct lockfile_handle	**hp;
+
+	spin_lock(&keep_busy);
+	for (hp = &keep_list; *hp && *hp != h; hp = &(*hp)->next)
+		;
+	if (*hp)
+		*hp = h->next;
+	if (add) {
+		h->next = keep_list;
+		keep_list = h;
+		if (!keep_atexit)
+			keep_atexit = (atexit(keep_cleanup) == 0);
+	}
+	spin_unlock(&keep_busy);
+}
+
+/*
+ *	L_KEEPTMP: make sure the handle's temp file exists and has
+ *	the right pid in it. Usually that costs nothing at all.
+ */
+static int keep_tmplock(struct lockfile_handle *h)
+{
+	pid_t	me = getpid();
+	pid_t	pid;
+	time_t	now;
+	int	fd = -1, r;
+
+	if ((r = lock_pid(h->flags, &pid)) != 0)
+		return r;
+	if (h->tmpowner == me && h->tmppid == pid) {
+		/* the lockfile gets the mtime of the temp file */
+		time(&now);
+		if (now - h->tmptime >= 60) {
+			lockfile_touch(h->tmplock);
+			h->tmptime = now;
+		}
+		return 0;
+	}
+
+	if (h->tmpowner == me) {
+		/* the pid to write changed */
+		unlink(h->tmplock);
+	} else {
+		/* first time, or a forked child: the name has our pid */
+		if ((r = lockfilename(h->lockfile, h->tmpname,
+				sizeof(h->tmpname))) != 0)
+			return r;
+		strcpy(h->tmplock, h->tmpname);
+		/* left behind by an earlier process with our pid? */
+		unlink(h->tmplock);
+	}
+	h->tmpowner = 0;
+	if ((r = write_tmplock(h->lockfile, h->tmplock, sizeof(h->tmplock),
+			h->flags & ~__L_HOLDFD, pid, &fd)) != 0) {
+		keep_register(h, 0);
+		return r;
+	}
+	h->tmpowner = me;
+	h->tmppid = pid;
+	h->tmptime = time(NULL);
+	keep_register(h, 1);
+	return 0;
+}
+
+/*
+ *	Initialize a lock handle. All names are computed here, so
+ *	that the other handle functions don't need to allocate
+ *	memory or call gethostname().
+ */
+int lockfile_handle_init(struct lockfile_handle *h, const char *lockfile,
+		int flags)
+{
+	int	r;
+
+	memset(h, 0, sizeof(*h));
+	h->args.fd = -1;
+	if ((flags & ~KNOWN_FLAGS) ||
+	    (flags & (__L_KEEPTMP|__L_HOLDFD)) == (__L_KEEPTMP|__L_HOLDFD) ||
+	    ((flags & __L_ABSTRACT) &&
+	     (flags & (__L_KEEPTMP|__L_HOLDFD|__L_THREAD|__L_WAITFOR))) ||
+	    durability_bad(flags)) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	h->flags = flags;
+	if (strlen(lockfile) >= sizeof(h->lockfile)) {
+		errno = ENAMETOOLONG;
+		return L_NAMELEN;
+	}
+	strcpy(h->lockfile, lockfile);
+	if ((r = lockfilename(lockfile, h->tmpname, sizeof(h->tmpname))) != 0)
+		return errno == ENAMETOOLONG || errno == EINVAL ? L_NAMELEN : r;
+	/* L_KEEPTMP: set once the temp file is there */
+	if (!(flags & __L_KEEPTMP))
+		h->tmpowner = getpid();
+	return 0;
+}
+
+int lockfile_handle_acquire(struct lockfile_handle *h, int retries)
+{
+	int	r;
+
+	if (h->locked) {
+		errno = EBUSY;
+		return L_ERROR;
+	}
+	if (h->flags & __L_KEEPTMP) {
+		if ((r = keep_tmplock(h)) != 0)
+			return r;
+	} else {
+		/* a forked child: the name has the parent's pid in it */
+		if (h->tmpowner != getpid()) {
+			if ((r = lockfilename(h->lockfile, h->tmpname,
+					sizeof(h->tmpname))) != 0)
+				return r;
+			h->tmpowner = getpid();
+		}
+		strcpy(h->tmplock, h->tmpname);
+	}
+	r = lockfile_create_tmplock(h->lockfile, h->tmplock,
+			sizeof(h->tmplock), retries, h->flags, &h->args);
+	if (r == L_SUCCESS)
+		h->locked = 1;
+	return r;
+}
+
+int lockfile_handle_release(struct lockfile_handle *h)
+{
+	int	r, e;
+
+	if (!h->locked)
+		return 0;
+	r = lockfile_remove(h->lockfile);
+	e = errno;
+	h->locked = 0;
+	/* with L_HOLDFD, the lock must be gone before the fd is closed */
+	if ((h->flags & __L_HOLDFD) && h->args.fd >= 0)
+		close(h->args.fd);
+	h->args.fd = -1;
+	errno = e;
+	return r;
+}
+
+/*
+ *	Release the lock, and remove the temp file that an
+ *	L_KEEPTMP handle keeps around.
+ */
+int lockfile_handle_close(struct lockfile_handle *h)
+{
+	int	r, e;
+
+	r = lockfile_handle_release(h);
+	e = errno;
+	if (h->flags & __L_KEEPTMP) {
+		keep_register(h, 0);
+		if (h->tmpowner == getpid() && h->tmplock[0])
+			unlink(h->tmplock);
+		h->tmpowner = 0;
+		h->tmplock[0] = 0;
+	}
+	errno = e;
+	return r;
+}
+
+int lockfile_handle_touch(struct lockfile_handle *h)
+{
+	if (h->flags & __L_ABSTRACT)
+		return 0;
+	if (h->args.fd >= 0)
+		return futimens(h->args.fd, NULL);
+	return lockfile_touch(h->lockfile);
+}
+
+/*
+ *	Remove the lockfile (if we hold it) and the temp lockfile (if
+ *	we're in the middle of creating it). Only uses unlink(), so this
+ *	is async-signal-safe and can be called from a signal handler.
+ */
+void lockfile_handle_sigrelease(struct lockfile_handle *h)
+{
+	int	e = errno;
+
+	if (h->tmplock[0] &&
+	    (!(h->flags & __L_KEEPTMP) || h->tmpowner == getpid()))
+		unlink(h->tmplock);
+	if (h->locked) {
+		if (h->flags & __L_ABSTRACT)
+			close(h->args.fd);
+		else
+			unlink(h->lockfile);
+		h->locked = 0;
+	}
+	errno = e;
+}
+
+#ifdef LIB
+static int lockfile_create_set_tmplock(const char *lockfile, int retries, int flags, struct __lockargs *args)
+{
+	char *tmplock;
+	int l, r, e;
+
+	l = strlen(lockfile)+TMPLOCKFILENAMESZ+1;
+	if ((tmplock = (char *)malloc(l)) == NULL)
+		return L_ERROR;
+	tmplock[0] = 0;
+	r = lockfile_create_tmplock(lockfile,
+						tmplock, l, retries, flags, args);
+	e = errno;
+	free(tmplock);
+	errno = e;
+	return r;
+}
+
+int lockfile_create(const char *lockfile, int retries, int flags)
+{
+	/* check against unknown flags */
+	if (flags & ~(L_PID|L_PPID)) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	return lockfile_create_set_tmplock(lockfile, retries, flags, NULL);
+}
+
+#ifdef STATIC
+int lockfile_create2(const char *lockfile, int retries,
+		int flags, struct __lockargs *args, int args_sz)
+{
+
+	/* check if size is the same (version check) */
+	if (args != NULL && sizeof(struct __lockargs) != args_sz) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	/* some flags _must_ have a non-null args */
+	if (args == NULL && (flags & FLAGS_WITH_ARGS)) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	/* check against unknown flags, L_KEEPTMP needs a handle */
+	if ((flags & ~(KNOWN_FLAGS & ~__L_KEEPTMP)) || durability_bad(flags)) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	return lockfile_create_set_tmplock(lockfile, retries, flags, args);
+}
+#endif
+
+#endif
+
+/*
+ *	See if a valid lockfile is present.
+ *	Returns 0 if so, -1 if not.
+ */
+int lockfile_check(const char *lockfile, int flags)
+{
+	struct stat	st;
+	int		fd, r;
+
+#ifdef LOCKSOCK
+	if (flags & __L_ABSTRACT)
+		return sock_check(lockfile);
+#endif
+	if (stat(lockfile, &st) < 0)
+		return -1;
+	fd = open(lockfile, O_RDONLY);
+	r = check_lock(fd, &st, flags, NULL);
+	if (fd >= 0)
+		close(fd);
+	return r;
+}
+
+/*
+ *	Remove a lock.
+ */
+int lockfile_remove(const char *lockfile)
+{
+#if defined(LOCKTABLE) || defined(LOCKSOCK)
+	int	r;
+#endif
+#ifdef LIB
+	int	flags;
+#endif
+
+#ifdef LOCKTABLE
+	if (lt_release(lockfile, &r) == 0)
+		return r;
+#endif
+#ifdef LOCKSOCK
+	if ((r = sock_release(lockfile)) != 1)
+		return r;
+#endif
+#ifdef LIB
+	flags = held_released(lockfile);
+#endif
+	if (unlink(lockfile) < 0) {
+#if defined(LIB) && defined(MAILGROUP)
+		if (errno == EACCES && is_maillock(lockfile))
+			return run_helper("-u", lockfile, 0, 0);
+#endif
+		return errno == ENOENT ? 0 : -1;
+	}
+#ifdef LOCKBOARD
+	board_wake(lockfile);
+#endif
+#ifdef LIB
+	ab_released(lockfile);
+	if ((flags & __L_SYNCDIR) && dir_sync(lockfile) < 0)
+		return -1;
+#endif
+	return 0;
+}
+
+/*
+ *	Touch a lock.
+ */
+int lockfile_touch(const char *lockfile)
 {
 #ifdef HAVE_UTIME
 	return utime(lockfile, NULL);
@@ -535,11 +3263,653 @@ int lockfile_touch(const char *lockfile)
 }
 
 #ifdef LIB
+/*
+ *	Sharded lock namespace. A logical lock "name" under "root" lives
+ *	in root/xx/yy/name.lock, where xx/yy are taken from a hash of the
+ *	name. This keeps the number of entries per directory bounded even
+ *	with hundreds of thousands of locks (and their temp files).
+ */
+#ifdef MAXPATHLEN
+#define NSPATHSZ		MAXPATHLEN
+#else
+#define NSPATHSZ		4096
+#endif
+
+int lockfile_ns_name(const char *root, const char *name, char *buf, int bufsz)
+{
+	unsigned int	h;
+	int		len;
+
+	if (name[0] == 0 || strchr(name, '/') != NULL ||
+	    strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	h = fnv_hash(name);
+	len = snprintf(buf, bufsz, "%s/%02x/%02x/%s.lock", root,
+			(h >> 24) & 0xff, (h >> 16) & 0xff, name);
+	if (len < 0 || len >= bufsz) {
+		errno = ENAMETOOLONG;
+		return L_NAMELEN;
+	}
+	return 0;
+}
+
+/*
+ *	Create the shard directories for a lockfile path
+ *	as returned by lockfile_ns_name().
+ */
+static int ns_mkdirs(char *path)
+{
+	char	*p, *q;
+	int	r = 0;
+
+	if ((q = strrchr(path, '/')) == NULL)
+		return 0;
+	*q = 0;
+	if ((p = strrchr(path, '/')) != NULL) {
+		*p = 0;
+		if (mkdir(path, 0777) < 0 && errno != EEXIST)
+			r = -1;
+		*p = '/';
+	}
+	if (r == 0 && mkdir(path, 0777) < 0 && errno != EEXIST)
+		r = -1;
+	*q = '/';
+	return r;
+}
+
+int lockfile_ns_create(const char *root, const char *name, int retries, int flags)
+{
+	char	path[NSPATHSZ];
+	int	r;
+
+	if ((r = lockfile_ns_name(root, name, path, sizeof(path))) != 0)
+		return r;
+	r = lockfile_create(path, retries, flags);
+	if (r == L_TMPLOCK && errno == ENOENT) {
+		/* shard directories are created on first use */
+		if (ns_mkdirs(path) < 0)
+			return L_TMPLOCK;
+		r = lockfile_create(path, retries, flags);
+	}
+	return r;
+}
+
+int lockfile_ns_remove(const char *root, const char *name)
+{
+	char	path[NSPATHSZ];
+
+	if (lockfile_ns_name(root, name, path, sizeof(path)) != 0)
+		return -1;
+	return lockfile_remove(path);
+}
+
+int lockfile_ns_touch(const char *root, const char *name)
+{
+	char	path[NSPATHSZ];
+
+	if (lockfile_ns_name(root, name, path, sizeof(path)) != 0)
+		return -1;
+	return lockfile_touch(path);
+}
+
+int lockfile_ns_check(const char *root, const char *name, int flags)
+{
+	char	path[NSPATHSZ];
+
+	if (lockfile_ns_name(root, name, path, sizeof(path)) != 0)
+		return -1;
+	return lockfile_check(path, flags);
+}
+#endif
+
+#ifdef LIB
+/*
+ *	Lock table file. Every logical lock "name" hashes to a bucket
+ *	of TB_WAYS entries in one pre-sized (sparse) table file, and
+ *	is held with an OFD write lock on one byte per entry. The
+ *	kernel drops the lock when the holder closes the file or dies,
+ *	so there are no stale locks and no directory operations at
+ *	all; that's what makes millions of fine-grained locks cheap.
+ *
+ *	An entry is claimed under the bucket mutex (an OFD lock on the
+ *	first byte of the bucket) after checking that no other entry of
+ *	the bucket holds the name, so one name is never locked twice.
+ *	The holder's pid, host and time are stored in the entry, for
+ *	people and lockfile_table_check(). Releasing only drops the
+ *	entry lock; the record stays and is reused.
+ *
+ *	Threads of one process share the table fd and with it the
+ *	OFD locks, so they serialize on an in-process spinlock first.
+ *	A second fd (another open file description) is used to see
+ *	the entry locks of this process as well.
+ */
+#ifdef F_OFD_SETLK
+#define TB_MAGIC	0x4c4b5431	/* "LKT1" */
+#define TB_WAYS		8		/* entries per bucket		*/
+#define TB_HDRSZ	4096
+#define TB_BUCKETS	65536		/* default size, 128 MB sparse	*/
+#define TB_MAXBUCKETS	(1 << 24)
+#define TB_NAMESZ	192
+#define TB_TABLES	8		/* open tables per process	*/
+#define TB_PATHSZ	512
+
+struct tb_header {
+	unsigned int	magic;
+	unsigned int	ways;
+	unsigned int	entsz;
+	unsigned int	nbuckets;
+};
+
+struct tb_entry {
+	unsigned int	used;		/* TB_MAGIC once claimed	*/
+	unsigned int	hash;
+	pid_t		owner;		/* process holding the OFD lock	*/
+	pid_t		pid;		/* L_PID / L_PPID		*/
+	long long	mtime;		/* created or touched, seconds	*/
+	char		host[40];
+	char		name[TB_NAMESZ];
+};
+
+static struct tb_table {
+	int		fd;		/* entry locks are taken here	*/
+	int		qfd;		/* and looked at through this	*/
+	pid_t		pid;		/* process that opened the fds	*/
+	unsigned int	nbuckets;
+	int		busy;		/* in-process bucket spinlock	*/
+	char		host[40];
+	char		path[TB_PATHSZ];
+} tb_tables[TB_TABLES];
+static int		tb_busy;
+
+static int tb_setlk(int fd, off_t off, int type, int cmd)
+{
+	struct flock	fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+	return fcntl(fd, cmd, &fl);
+}
+
+/*
+ *	Is the byte at "off" locked by anyone, this process included?
+ */
+static int tb_locked(struct tb_table *t, off_t off)
+{
+	struct flock	fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+	if (fcntl(t->qfd, F_OFD_GETLK, &fl) < 0)
+		return -1;
+	return fl.l_type != F_UNLCK;
+}
+
+static off_t tb_bucket(struct tb_table *t, const char *name, unsigned int *h)
+{
+	*h = fnv_hash(name);
+	return TB_HDRSZ + (off_t)(*h % t->nbuckets) *
+		TB_WAYS * sizeof(struct tb_entry);
+}
+
+static int tb_read(struct tb_table *t, off_t off, struct tb_entry *ents)
+{
+	int	i;
+
+	/* past the end of the file, the table is all zeroes */
+	memset(ents, 0, TB_WAYS * sizeof(*ents));
+	if (pread(t->qfd, ents, TB_WAYS * sizeof(*ents), off) < 0)
+		return -1;
+	for (i = 0; i < TB_WAYS; i++)
+		ents[i].name[TB_NAMESZ - 1] = 0;
+	return 0;
+}
+
+/*
+ *	Index of the entry that has "name" in it, or -1. There is
+ *	at most one, see tb_try().
+ */
+static int tb_find(struct tb_entry *ents, unsigned int h, const char *name)
+{
+	int	i;
+
+	for (i = 0; i < TB_WAYS; i++)
+		if (ents[i].used == TB_MAGIC && ents[i].hash == h &&
+		    strcmp(ents[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ *	Open the table file, and initialize it if it is new. The
+ *	header is written under a lock on byte 0, before the file
+ *	is extended, so nobody ever sees a half-made table.
+ */
+static int tb_open(struct tb_table *t, const char *path,
+		unsigned int nbuckets, int create)
+{
+	struct tb_header	hd;
+	struct stat		st;
+	int			fd, qfd = -1, e;
+
+	if ((fd = open(path, O_RDWR|O_CLOEXEC|(create ? O_CREAT : 0),
+			0666)) < 0)
+		return -1;
+	if ((qfd = open(path, O_RDONLY|O_CLOEXEC)) < 0 ||
+	    tb_setlk(fd, 0, F_WRLCK, F_OFD_SETLKW) < 0 ||
+	    fstat(fd, &st) < 0)
+		goto fail;
+	memset(&hd, 0, sizeof(hd));
+	if (st.st_size == 0 && create) {
+		hd.magic = TB_MAGIC;
+		hd.ways = TB_WAYS;
+		hd.entsz = sizeof(struct tb_entry);
+		hd.nbuckets = nbuckets;
+		if (pwrite(fd, &hd, sizeof(hd), 0) != sizeof(hd) ||
+		    ftruncate(fd, TB_HDRSZ + (off_t)nbuckets *
+				TB_WAYS * sizeof(struct tb_entry)) < 0)
+			goto fail;
+	} else if (pread(fd, &hd, sizeof(hd), 0) != sizeof(hd) ||
+		   hd.magic != TB_MAGIC || hd.ways != TB_WAYS ||
+		   hd.entsz != sizeof(struct tb_entry) ||
+		   hd.nbuckets == 0 || hd.nbuckets > TB_MAXBUCKETS) {
+		errno = EINVAL;
+		goto fail;
+	}
+	tb_setlk(fd, 0, F_UNLCK, F_OFD_SETLK);
+
+	if (gethostname(t->host, sizeof(t->host)) < 0)
+		t->host[0] = 0;
+	t->host[sizeof(t->host) - 1] = 0;
+	t->fd = fd;
+	t->qfd = qfd;
+	t->nbuckets = hd.nbuckets;
+	t->busy = 0;
+	t->pid = getpid();
+	return 0;
+fail:
+	e = errno;
+	close(fd);
+	if (qfd >= 0)
+		close(qfd);
+	errno = e;
+	return -1;
+}
+
+/*
+ *	The open table for "path". After a fork() the inherited fds
+ *	share the parent's locks, so the child opens its own.
+ */
+static struct tb_table *tb_get(const char *path, unsigned int nbuckets,
+		int create)
+{
+	struct tb_table	*t, *ret = NULL;
+	pid_t		pid = getpid();
+	int		i;
+
+	if (strlen(path) >= TB_PATHSZ) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	spin_lock(&tb_busy);
+	for (i = 0; i < TB_TABLES && ret == NULL; i++)
+		if (strcmp(tb_tables[i].path, path) == 0)
+			ret = &tb_tables[i];
+	if (ret && ret->pid != pid) {
+		close(ret->fd);
+		close(ret->qfd);
+		if (tb_open(ret, path, nbuckets, create) < 0) {
+			ret->path[0] = 0;
+			ret = NULL;
+		}
+	} else if (ret == NULL) {
+		for (i = 0; i < TB_TABLES && tb_tables[i].path[0]; i++)
+			;
+		t = &tb_tables[i];
+		if (i == TB_TABLES)
+			errno = EMFILE;
+		else if (tb_open(t, path, nbuckets, create) == 0) {
+			strcpy(t->path, path);
+			ret = t;
+		}
+	}
+	spin_unlock(&tb_busy);
+	return ret;
+}
+
+/*
+ *	One attempt to lock "name". Returns 0 if we got it, 1 if it
+ *	is held (or its bucket is full), -1 on error.
+ */
+static int tb_try(struct tb_table *t, const char *name, int flags)
+{
+	struct tb_entry	ents[TB_WAYS], *e;
+	unsigned int	h;
+	off_t		off;
+	pid_t		pid;
+	int		i, l, r = 1;
+
+	off = tb_bucket(t, name, &h);
+	spin_lock(&t->busy);
+	if (tb_setlk(t->fd, off, F_WRLCK, F_OFD_SETLKW) < 0) {
+		spin_unlock(&t->busy);
+		return -1;
+	}
+	if (tb_read(t, off, ents) < 0) {
+		r = -1;
+		goto out;
+	}
+
+	/*
+	 *	The entry that had this name before comes first, so the
+	 *	name never ends up in two entries. Then unused ones,
+	 *	which nobody can lock without the bucket mutex, then the
+	 *	ones whose holder has let go.
+	 */
+	if ((i = tb_find(ents, h, name)) >= 0) {
+		if ((l = tb_locked(t, off + 1 + i)) != 0) {
+			r = l < 0 ? -1 : 1;
+			goto out;
+		}
+	} else {
+		for (i = 0; i < TB_WAYS && ents[i].used == TB_MAGIC; i++)
+			;
+		if (i == TB_WAYS) {
+			for (i = 0; i < TB_WAYS; i++)
+				if ((l = tb_locked(t, off + 1 + i)) != 1)
+					break;
+			if (i == TB_WAYS)
+				goto out;
+			if (l < 0) {
+				r = -1;
+				goto out;
+			}
+		}
+	}
+	if (tb_setlk(t->fd, off + 1 + i, F_WRLCK, F_OFD_SETLK) < 0) {
+		r = -1;
+		goto out;
+	}
+
+	e = &ents[i];
+	memset(e, 0, sizeof(*e));
+	e->used = TB_MAGIC;
+	e->hash = h;
+	e->owner = t->pid;
+	e->mtime = time(NULL);
+	strcpy(e->host, t->host);
+	strcpy(e->name, name);
+	if (lock_pid(flags, &pid) == 0)
+		e->pid = pid;
+	if (pwrite(t->fd, e, sizeof(*e), off + i * sizeof(*e)) !=
+			sizeof(*e)) {
+		tb_setlk(t->fd, off + 1 + i, F_UNLCK, F_OFD_SETLK);
+		r = -1;
+		goto out;
+	}
+	r = 0;
+out:
+	l = errno;
+	tb_setlk(t->fd, off, F_UNLCK, F_OFD_SETLK);
+	spin_unlock(&t->busy);
+	errno = l;
+	return r;
+}
+
+/*
+ *	The entry of "name" if this process holds it, or -1.
+ */
+static int tb_mine(struct tb_table *t, const char *name, off_t *offp,
+		struct tb_entry *ents)
+{
+	unsigned int	h;
+	int		i;
+
+	*offp = tb_bucket(t, name, &h);
+	if (tb_read(t, *offp, ents) < 0)
+		return -1;
+	if ((i = tb_find(ents, h, name)) < 0 || ents[i].owner != t->pid) {
+		errno = ENOENT;
+		return -1;
+	}
+	return i;
+}
+
+static int tb_name(const char *name)
+{
+	if (name[0] == 0) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	if (strlen(name) >= TB_NAMESZ) {
+		errno = ENAMETOOLONG;
+		return L_NAMELEN;
+	}
+	return 0;
+}
+
+int lockfile_table_init(const char *table, unsigned int nbuckets)
+{
+	if (nbuckets == 0 || nbuckets > TB_MAXBUCKETS) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	return tb_get(table, nbuckets, 1) ? 0 : L_ERROR;
+}
+
+int lockfile_table_create(const char *table, const char *name,
+		int retries, int flags)
+{
+	struct backoff	bo;
+	struct tb_table	*t;
+	int		sleeptime = 0;
+	int		tries = retries + 1;
+	int		i, r;
+
+	if ((r = tb_name(name)) != 0)
+		return r;
+	if (flags & ~(L_PID|L_PPID)) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+	if ((t = tb_get(table, TB_BUCKETS, 1)) == NULL)
+		return L_ERROR;
+	memset(&bo, 0, sizeof(bo));
+	for (i = 0; i < tries; i++) {
+		if (i > 0 && (r = retry_sleep(backoff_ms(&bo, &sleeptime,
+				flags), flags, NULL, NULL, 0)) != 0)
+			return r;
+		if ((r = tb_try(t, name, flags)) <= 0)
+			return r < 0 ? L_ERROR : L_SUCCESS;
+	}
+	errno = EAGAIN;
+	return L_MAXTRYS;
+}
+
+int lockfile_table_remove(const char *table, const char *name)
+{
+	struct tb_entry	ents[TB_WAYS];
+	struct tb_table	*t;
+	off_t		off;
+	int		i;
+
+	if (tb_name(name) != 0 || (t = tb_get(table, 0, 0)) == NULL ||
+	    (i = tb_mine(t, name, &off, ents)) < 0)
+		return -1;
+	return tb_setlk(t->fd, off + 1 + i, F_UNLCK, F_OFD_SETLK);
+}
+
+int lockfile_table_touch(const char *table, const char *name)
+{
+	struct tb_entry	ents[TB_WAYS];
+	struct tb_table	*t;
+	long long	now = time(NULL);
+	off_t		off;
+	int		i;
+
+	if (tb_name(name) != 0 || (t = tb_get(table, 0, 0)) == NULL ||
+	    (i = tb_mine(t, name, &off, ents)) < 0)
+		return -1;
+	off += i * sizeof(struct tb_entry) + offsetof(struct tb_entry, mtime);
+	return pwrite(t->fd, &now, sizeof(now), off) == sizeof(now) ? 0 : -1;
+}
+
+int lockfile_table_check(const char *table, const char *name, int flags)
+{
+	struct tb_entry	ents[TB_WAYS];
+	struct tb_table	*t;
+	unsigned int	h;
+	off_t		off;
+	int		i;
+
+	(void)flags;
+	if (tb_name(name) != 0 || (t = tb_get(table, 0, 0)) == NULL)
+		return -1;
+	off = tb_bucket(t, name, &h);
+	if (tb_read(t, off, ents) < 0 || (i = tb_find(ents, h, name)) < 0)
+		return -1;
+	return tb_locked(t, off + 1 + i) == 1 ? 0 : -1;
+}
+#else /* F_OFD_SETLK */
+int lockfile_table_init(const char *table, unsigned int nbuckets)
+{
+	errno = ENOSYS;
+	return L_ERROR;
+}
+
+int lockfile_table_create(const char *table, const char *name,
+		int retries, int flags)
+{
+	errno = ENOSYS;
+	return L_ERROR;
+}
+
+int lockfile_table_remove(const char *table, const char *name)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int lockfile_table_touch(const char *table, const char *name)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int lockfile_table_check(const char *table, const char *name, int flags)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif /* F_OFD_SETLK */
+#endif /* LIB */
+
+#ifdef LIB
+#ifdef F_OFD_SETLK
+#define MBOX_SETLK	F_OFD_SETLK
+#define MBOX_SETLKW	F_OFD_SETLKW
+#else
+#define MBOX_SETLK	F_SETLK
+#define MBOX_SETLKW	F_SETLKW
+#endif
+
+/*
+ *	Lock ("type" F_WRLCK) or unlock (F_UNLCK) the whole mailbox
+ *	in the kernel; "cmd" MBOX_SETLKW waits for it.
+ */
+static int mailbox_setlk(int cmd, int type)
+{
+	struct flock	fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	return fcntl(mboxfd, cmd, &fl);
+}
+
+/*
+ *	Take the dotlock and a kernel write lock on the mailbox itself
+ *	(the lockfile name minus ".lock"). We never wait for one while
+ *	holding the other, so a process that takes them in the other
+ *	order can't deadlock with us. The dotlock is waited for as
+ *	usual, then the mailbox is only tried. If it is busy we let go
+ *	of the dotlock and wait for the mailbox in the kernel, which
+ *	costs no sleeping and no filesystem traffic, and then only try
+ *	the dotlock. If that is busy, the mailbox goes again and we
+ *	start over; after "retries" rounds we give up.
+ *	A missing mailbox is not an error - there's nothing to lock yet.
+ */
+static int mailbox_lock(const char *lockfile, int retries)
+{
+	char		*mbox;
+	int		len, e, i, round;
+
+	len = strlen(lockfile) - 5;
+	if ((mbox = (char *)malloc(len + 1)) == NULL)
+		return L_ERROR;
+	memcpy(mbox, lockfile, len);
+	mbox[len] = 0;
+	mboxfd = open(mbox, O_RDWR|O_CLOEXEC);
+	e = errno;
+	free(mbox);
+	if (mboxfd < 0) {
+		errno = e;
+		return errno == ENOENT ?
+			lockfile_create(lockfile, retries, 0) : L_ERROR;
+	}
+
+	for (round = 0; ; round++) {
+		if ((i = lockfile_create(lockfile, retries, 0)) != 0)
+			break;
+		if (mailbox_setlk(MBOX_SETLK, F_WRLCK) == 0)
+			return 0;
+		e = (errno == EACCES) ? EAGAIN : errno;
+		lockfile_remove(lockfile);
+		errno = e;
+		i = (e == EAGAIN) ? L_MAXTRYS : L_ERROR;
+		if (i != L_MAXTRYS || round >= retries)
+			break;
+
+		if (mailbox_setlk(MBOX_SETLKW, F_WRLCK) < 0) {
+			i = L_ERROR;
+			break;
+		}
+		if ((i = lockfile_create(lockfile, 0, 0)) == 0)
+			return 0;
+		e = errno;
+		(void)mailbox_setlk(MBOX_SETLK, F_UNLCK);
+		errno = e;
+		if (i != L_MAXTRYS)
+			break;
+	}
+	e = errno;
+	close(mboxfd);
+	mboxfd = -1;
+	errno = e;
+	return i;
+}
+
 /*
  *	Lock a mailfile. This looks a lot like the SVR4 function.
  *	Arguments: lusername, retries.
  */
 int maillock(const char *name, int retries)
+{
+	return maillock2(name, retries, 0);
+}
+
+/*
+ *	Same as maillock(), with flags. With ML_FCNTL the mailbox
+ *	itself is locked with fcntl() as well, see mailbox_lock().
+ */
+int maillock2(const char *name, int retries, int flags)
 {
 	char		*p, *mail;
 	char		*newlock;
@@ -548,6 +3918,11 @@ int maillock(const char *name, int retries)
 
 	if (islocked) return 0;
 
+	if (flags & ~ML_FCNTL) {
+		errno = EINVAL;
+		return L_ERROR;
+	}
+
 #ifdef MAXPATHLEN
 	if (strlen(name) + sizeof(MAILDIR) + 6 > MAXPATHLEN) {
 		errno = ENAMETOOLONG;
@@ -592,8 +3967,12 @@ int maillock(const char *name, int retries)
 			sprintf(mlockfile, "%s.lock", mail);
 		}
 	}
-	i = lockfile_create(mlockfile, retries, 0);
-	if (i == 0) islocked = 1;
+	if (flags & ML_FCNTL)
+		i = mailbox_lock(mlockfile, retries);
+	else
+		i = lockfile_create(mlockfile, retries, 0);
+	if (i == 0)
+		islocked = 1;
 
 	return i;
 }
@@ -601,6 +3980,15 @@ int maillock(const char *name, int retries)
 void mailunlock(void)
 {
 	if (!islocked) return;
+	/*
+	 *	Closing the mailbox releases the fcntl lock. That goes
+	 *	first: the dotlock is what waiters that use both look
+	 *	at last.
+	 */
+	if (mboxfd >= 0) {
+		close(mboxfd);
+		mboxfd = -1;
+	}
 	lockfile_remove(mlockfile);
 	free (mlockfile);
 	islocked = 0;
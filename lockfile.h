@@ -13,6 +13,9 @@
 #ifndef _LOCKFILE_H
 #define _LOCKFILE_H
 
+#include <sys/types.h>
+#include <time.h>
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -25,6 +28,27 @@ int	lockfile_remove(const char *lockfile);
 int	lockfile_touch(const char *lockfile);
 int	lockfile_check(const char *lockfile, int flags);
 
+/*
+ *	Sharded namespace: "name" is locked as root/xx/yy/name.lock
+ */
+int	lockfile_ns_name(const char *root, const char *name,
+		char *buf, int bufsz);
+int	lockfile_ns_create(const char *root, const char *name,
+		int retries, int flags);
+int	lockfile_ns_remove(const char *root, const char *name);
+int	lockfile_ns_touch(const char *root, const char *name);
+int	lockfile_ns_check(const char *root, const char *name, int flags);
+
+/*
+ *	Lock table: "name" is an OFD-locked entry in the table file "table".
+ */
+int	lockfile_table_init(const char *table, unsigned int nbuckets);
+int	lockfile_table_create(const char *table, const char *name,
+		int retries, int flags);
+int	lockfile_table_remove(const char *table, const char *name);
+int	lockfile_table_touch(const char *table, const char *name);
+int	lockfile_table_check(const char *table, const char *name, int flags);
+
 /*
  *	Return values for lockfile_create()
  */
@@ -37,6 +61,9 @@ int	lockfile_check(const char *lockfile, int flags);
 #define L_MANLOCK	6	/* Cannot set mandatory lock on tempfile */
 #define L_ORPHANED	7	/* Called with L_PPID but parent is gone */
 #define L_RMSTALE	8	/* Failed to remove stale lockfile	*/
+#define L_TIMEOUT	9	/* Deadline passed (L_DEADLINE)		*/
+#define L_CANCELLED	10	/* Cancel fd became readable		*/
+#define L_DEADLOCK	11	/* Waiting would deadlock (L_WAITFOR)	*/
 
 /*
  *	Flag values for lockfile_create()
@@ -49,15 +76,97 @@ int	lockfile_check(const char *lockfile, int flags);
  */
 struct __lockargs {
 	int interval;		/* Static interval between retries	*/
+	int fd;			/* Returned holder fd (L_HOLDFD)	*/
+#if defined(_POSIX_C_SOURCE) || defined(TIME_UTC) || defined(__cplusplus)
+	struct timespec deadline; /* CLOCK_MONOTONIC (L_DEADLINE)	*/
+#else
+	/* strict ISO C99 has no struct timespec: same layout */
+	struct { time_t tv_sec; long tv_nsec; } deadline;
+#endif
+	int cancelfd;		/* Give up when readable (L_CANCELFD)	*/
 };
 #define __L_INTERVAL	64	/* Specify consistent retry interval	*/
+#define __L_HOLDFD	128	/* Keep lock alive with an open fd	*/
+#define __L_DEADLINE	256	/* Give up at an absolute time		*/
+#define __L_CANCELFD	512	/* Give up when an fd becomes readable	*/
+#define __L_THREAD	1024	/* Threads queue in-process first	*/
+#define __L_RECURSIVE	2048	/* Owning thread may lock again		*/
+#define __L_PROBE	4096	/* look before creating a temp file	*/
+#define __L_KEEPTMP	8192	/* Handle keeps its temp file around	*/
+#define __L_BOARD	16384	/* Wait on a shared-memory board	*/
+#define __L_ADAPTIVE	32768	/* Learn hold times, retry around them	*/
+#define __L_ABSTRACT	65536	/* Host-local lock on an abstract socket */
+#define __L_WAITFOR	131072	/* Publish what we wait for, find cycles */
+#define __L_LOCAL	262144	/* One waiter per host goes to the file	*/
+#define __L_NOCONTENT	524288	/* Leave the lockfile empty		*/
+#define __L_SYNC	1048576	/* fsync() the temp file before link()	*/
+#define __L_SYNCDIR	2097152	/* fsync() the directory after (un)link	*/
 #ifdef LOCKFILE_EXPERIMENTAL
 #define lockargs	__lockargs
 #define L_INTERVAL	__L_INTERVAL
+#define L_HOLDFD	__L_HOLDFD
+#define L_DEADLINE	__L_DEADLINE
+#define L_CANCELFD	__L_CANCELFD
+#define L_THREAD	__L_THREAD
+#define L_RECURSIVE	__L_RECURSIVE
+#define L_PROBE		__L_PROBE
+#define L_KEEPTMP	__L_KEEPTMP
+#define L_BOARD		__L_BOARD
+#define L_ADAPTIVE	__L_ADAPTIVE
+#define L_ABSTRACT	__L_ABSTRACT
+#define L_WAITFOR	__L_WAITFOR
+#define L_LOCAL		__L_LOCAL
+#define L_NOCONTENT	__L_NOCONTENT
+#define L_SYNC		__L_SYNC
+#define L_SYNCDIR	__L_SYNCDIR
+#define L_DURABLE_NONE	L_NOCONTENT
+#define L_DURABLE_CONTENT L_SYNC
+#define L_DURABLE_FULL	(L_SYNC|L_SYNCDIR)
 int	lockfile_create2(const char *lockfile, int retries,
 		int flags, struct lockargs *args, int args_sz);
 #endif
 
+/*
+ *	Lock handle. Owned by the caller; the lock and temp lock
+ *	names are computed once by lockfile_handle_init(), after that
+ *	nothing allocates memory. lockfile_handle_sigrelease() is
+ *	async-signal-safe.
+ */
+#define LOCKFILE_PATHSZ	4096
+struct lockfile_handle {
+	int		flags;
+	volatile int	locked;		/* Lock is held			*/
+	struct __lockargs args;		/* Arguments for flags		*/
+	char		lockfile[LOCKFILE_PATHSZ];
+	char		tmpname[LOCKFILE_PATHSZ];
+	char		tmplock[LOCKFILE_PATHSZ];	/* Set while in use */
+	pid_t		tmppid;		/* L_KEEPTMP: pid in the temp file */
+	pid_t		tmpowner;	/* Process tmpname is for	*/
+	time_t		tmptime;	/* When it was created/touched	*/
+	struct lockfile_handle *next;
+};
+int	lockfile_handle_init(struct lockfile_handle *h,
+		const char *lockfile, int flags);
+int	lockfile_handle_acquire(struct lockfile_handle *h, int retries);
+int	lockfile_handle_release(struct lockfile_handle *h);
+int	lockfile_handle_touch(struct lockfile_handle *h);
+int	lockfile_handle_close(struct lockfile_handle *h);
+void	lockfile_handle_sigrelease(struct lockfile_handle *h);
+
+/*
+ *	What L_ADAPTIVE learned about a lock in this process.
+ */
+struct lockfile_stats {
+	long		hold_ms;	/* Typical hold time, -1 if unknown */
+	long		wait_ms;	/* Typical wait when contended	*/
+	unsigned int	acquired;	/* Times we got the lock	*/
+	unsigned int	contended;	/* ... and had to wait for it	*/
+	unsigned int	samples;	/* Hold times seen		*/
+};
+int	lockfile_stats_query(const char *lockfile, struct lockfile_stats *st);
+int	lockfile_stats_save(const char *file);
+int	lockfile_stats_load(const char *file);
+
 #ifdef  __cplusplus
 }
 #endif
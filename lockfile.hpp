@@ -0,0 +1,607 @@
+/*
+ *	Copyright (C) Miquel van Smoorenburg and contributors 1999-2021.
+ *
+ *	This library is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU Library General Public License as
+ *	published by the Free Software Foundation; either version 2 of the
+ *	License, or (at your option) any later version.
+ *
+ *	C++20 wrapper around lockfile.h: a movable RAII guard, deadlines
+ *	and cancellation based on <chrono> and std::stop_token, an
+ *	awaitable for coroutines that doesn't block a thread while the
+ *	lock is contended, and basic_lockfile, a lock whose backoff,
+ *	liveness check and strategy are chosen at compile time.
+ */
+#ifndef _LOCKFILE_HPP
+#define _LOCKFILE_HPP
+
+#if __cplusplus < 202002L
+#error lockfile.hpp needs C++20
+#endif
+
+#include <lockfile.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <system_error>
+#include <utility>
+
+namespace lockfile {
+
+using clock = std::chrono::steady_clock;
+
+/*
+ *	Error category for the L_* return values of lockfile_create().
+ *	Running out of time or being cancelled is reported as
+ *	std::errc::timed_out / std::errc::operation_canceled instead.
+ */
+class category_impl : public std::error_category {
+public:
+	const char *name() const noexcept override { return "lockfile"; }
+	std::string message(int ev) const override
+	{
+		switch (ev) {
+		case L_SUCCESS:		return "lockfile created";
+		case L_NAMELEN:		return "name too long";
+		case L_TMPLOCK:		return "error creating temp lockfile";
+		case L_TMPWRITE:	return "can't write pid into temp lockfile";
+		case L_MAXTRYS:		return "failed after max. number of attempts";
+		case L_ERROR:		return "unknown error";
+		case L_MANLOCK:		return "cannot set mandatory lock on tempfile";
+		case L_ORPHANED:	return "called with L_PPID but parent is gone";
+		case L_RMSTALE:		return "failed to remove stale lockfile";
+		case L_TIMEOUT:		return "deadline passed";
+		case L_CANCELLED:	return "cancelled";
+		case L_DEADLOCK:	return "waiting would deadlock";
+		}
+		return "unknown lockfile error";
+	}
+};
+
+inline const std::error_category &error_category() noexcept
+{
+	static const category_impl cat;
+	return cat;
+}
+
+/*
+ *	Turn a lockfile_create() return value into an error_code.
+ *	L_ERROR carries errno, that's more useful.
+ */
+inline std::error_code make_error_code(int r, int e = errno) noexcept
+{
+	if (r == L_SUCCESS)
+		return {};
+	if (r == L_ERROR && e != 0)
+		return std::error_code(e, std::generic_category());
+	return std::error_code(r, error_category());
+}
+
+/*
+ *	Retry schedule. The defaults are the same as the C library:
+ *	5 seconds, 5 seconds longer after every try, at most 60 seconds.
+ */
+struct backoff {
+	clock::duration initial = std::chrono::seconds(5);
+	clock::duration step = std::chrono::seconds(5);
+	clock::duration max = std::chrono::seconds(60);
+
+	clock::duration next(clock::duration prev) const noexcept
+	{
+		auto d = prev == clock::duration::zero() ? initial : prev + step;
+		return d > max ? max : d;
+	}
+};
+
+/*
+ *	A held lock. Movable, not copyable; the destructor releases it.
+ */
+class lock {
+public:
+	lock() noexcept = default;
+	lock(lock &&o) noexcept : h_(std::move(o.h_)) {}
+	lock &operator=(lock &&o) noexcept
+	{
+		if (this != &o) {
+			release();
+			h_ = std::move(o.h_);
+		}
+		return *this;
+	}
+	lock(const lock &) = delete;
+	lock &operator=(const lock &) = delete;
+	~lock() { release(); }
+
+	bool owns_lock() const noexcept { return h_ && h_->locked; }
+	explicit operator bool() const noexcept { return owns_lock(); }
+	const char *path() const noexcept { return h_ ? h_->lockfile : ""; }
+
+	/* holder fd for L_HOLDFD locks, -1 otherwise */
+	int fd() const noexcept { return h_ ? h_->args.fd : -1; }
+
+	std::error_code touch() noexcept
+	{
+		if (!owns_lock())
+			return std::make_error_code(std::errc::bad_file_descriptor);
+		if (lockfile_handle_touch(h_.get()) < 0)
+			return std::error_code(errno, std::generic_category());
+		return {};
+	}
+
+	void release() noexcept
+	{
+		if (h_)
+			lockfile_handle_close(h_.get());
+		h_.reset();
+	}
+
+	/*
+	 *	A lock that isn't held yet: the handle is set up, and
+	 *	try_lock() can be called on it as often as needed without
+	 *	setting it up again. Empty, with "ec" set, on failure.
+	 */
+	lock(const std::string &path, int flags, std::error_code &ec)
+		: h_(std::make_unique<lockfile_handle>())
+	{
+		int r = lockfile_handle_init(h_.get(), path.c_str(), flags);
+
+		ec = make_error_code(r, errno);
+		if (r != L_SUCCESS)
+			h_.reset();
+	}
+
+	/*
+	 *	One non-blocking attempt: create the lockfile if it's
+	 *	free (or stale), don't wait if it's held. A contended
+	 *	lock is reported as L_MAXTRYS in the lockfile category.
+	 */
+	std::error_code try_lock() noexcept
+	{
+		if (!h_)
+			return std::make_error_code(std::errc::bad_file_descriptor);
+		if (h_->locked)
+			return {};
+		int r = lockfile_handle_acquire(h_.get(), 0);
+		return make_error_code(r, errno);
+	}
+
+	static lock try_acquire(const std::string &path, int flags,
+			std::error_code &ec)
+	{
+		lock l(path, flags, ec);
+		if (!ec)
+			ec = l.try_lock();
+		if (ec)
+			l.release();
+		return l;
+	}
+
+private:
+	std::unique_ptr<lockfile_handle> h_;
+};
+
+inline bool contended(const std::error_code &ec) noexcept
+{
+	return ec == std::error_code(L_MAXTRYS, error_category());
+}
+
+/*
+ *	Acquire a lock, waiting until "deadline" at most. Returns an
+ *	empty lock and sets "ec" on failure. The wait ends early if
+ *	a stop is requested on "st".
+ */
+inline lock acquire(const std::string &path, clock::time_point deadline,
+		std::error_code &ec, std::stop_token st = {},
+		int flags = L_PID, backoff b = {})
+{
+	std::mutex m;
+	std::condition_variable_any cv;
+	clock::duration delay = clock::duration::zero();
+	lock l(path, flags, ec);
+
+	if (ec)
+		return {};
+	for (;;) {
+		if (st.stop_requested()) {
+			ec = std::make_error_code(std::errc::operation_canceled);
+			return {};
+		}
+		ec = l.try_lock();
+		if (!ec)
+			return l;
+		if (!contended(ec))
+			return {};
+		auto now = clock::now();
+		if (now >= deadline) {
+			ec = std::make_error_code(std::errc::timed_out);
+			return {};
+		}
+		delay = b.next(delay);
+		auto until = now + delay < deadline ? now + delay : deadline;
+		std::unique_lock<std::mutex> lk(m);
+		cv.wait_until(lk, st, until, [] { return false; });
+	}
+}
+
+inline lock acquire(const std::string &path, clock::time_point deadline,
+		std::stop_token st = {}, int flags = L_PID, backoff b = {})
+{
+	std::error_code ec;
+	lock l = acquire(path, deadline, ec, st, flags, b);
+	if (ec)
+		throw std::system_error(ec, path);
+	return l;
+}
+
+template<class Rep, class Period>
+inline lock acquire_for(const std::string &path,
+		std::chrono::duration<Rep, Period> timeout,
+		std::stop_token st = {}, int flags = L_PID, backoff b = {})
+{
+	return acquire(path, clock::now() + timeout, st, flags, b);
+}
+
+/*
+ *	Anything that can run a callback after a delay, for example
+ *	a wrapper around an event loop's timers.
+ */
+template<class S>
+concept scheduler = requires(S &s, clock::duration d,
+		std::function<void()> f) {
+	s.schedule_after(d, std::move(f));
+};
+
+/*
+ *	co_await async_acquire(path, sched, deadline) - while the
+ *	lock is contended, the coroutine is suspended and the next
+ *	attempt is scheduled on "sched"; no thread sleeps. A stop
+ *	request resumes it right away, from the thread that makes it.
+ *	Attempts that are still scheduled by then do nothing.
+ */
+template<scheduler S>
+class async_acquire {
+public:
+	async_acquire(std::string path, S &sched, clock::time_point deadline,
+			std::stop_token st = {}, int flags = L_PID,
+			backoff b = {})
+		: path_(std::move(path)), sched_(sched), deadline_(deadline),
+		  st_(std::move(st)), flags_(flags), b_(b),
+		  lock_(path_, flags_, ec_) {}
+
+	bool await_ready() { return attempt(); }
+
+	/*
+	 *	The stop callback may run right away, and the scheduler
+	 *	may run the first attempt before we return: whoever
+	 *	finishes first resumes the coroutine, or leaves that to
+	 *	us by returning false if we're not done here yet.
+	 */
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		auto s = state_;
+
+		s->waiter = h;
+		stop_.emplace(st_, waker{this});
+		schedule();
+		std::lock_guard<std::mutex> lk(s->m);
+		if (s->done)
+			return false;
+		s->armed = true;
+		return true;
+	}
+
+	/* throws std::system_error if no lock was obtained */
+	lock await_resume()
+	{
+		if (ec_)
+			throw std::system_error(ec_, path_);
+		return std::move(lock_);
+	}
+
+private:
+	/* who resumes the coroutine; outlives us in scheduled attempts */
+	struct state {
+		std::mutex		m;
+		bool			done = false;
+		bool			armed = false;
+		std::coroutine_handle<>	waiter;
+	};
+
+	struct waker {
+		async_acquire	*a;
+		void operator()() noexcept { a->stopped(); }
+	};
+
+	/* true if done: got the lock, or gave up */
+	bool attempt()
+	{
+		if (ec_ && !contended(ec_))
+			return true;
+		if (st_.stop_requested()) {
+			ec_ = std::make_error_code(std::errc::operation_canceled);
+			return true;
+		}
+		ec_ = lock_.try_lock();
+		if (!contended(ec_))
+			return true;
+		if (clock::now() >= deadline_) {
+			ec_ = std::make_error_code(std::errc::timed_out);
+			return true;
+		}
+		return false;
+	}
+
+	/* with s->m held */
+	void finish(std::shared_ptr<state> &s, std::unique_lock<std::mutex> &lk)
+	{
+		s->done = true;
+		if (!s->armed)
+			return;
+		lk.unlock();
+		s->waiter.resume();
+	}
+
+	void stopped() noexcept
+	{
+		auto s = state_;
+		std::unique_lock<std::mutex> lk(s->m);
+
+		if (s->done)
+			return;
+		ec_ = std::make_error_code(std::errc::operation_canceled);
+		finish(s, lk);
+	}
+
+	void schedule()
+	{
+		delay_ = b_.next(delay_);
+		auto left = deadline_ - clock::now();
+		if (left < clock::duration::zero())
+			left = clock::duration::zero();
+		sched_.schedule_after(delay_ < left ? delay_ : left,
+				[this, s = state_]() mutable {
+			std::unique_lock<std::mutex> lk(s->m);
+
+			if (s->done)
+				return;
+			if (attempt())
+				finish(s, lk);
+			else
+				schedule();
+		});
+	}
+
+	std::string		path_;
+	S			&sched_;
+	clock::time_point	deadline_;
+	std::stop_token		st_;
+	int			flags_;
+	backoff			b_;
+	clock::duration		delay_ = clock::duration::zero();
+	std::error_code		ec_;
+	lock			lock_;
+	std::shared_ptr<state>	state_ = std::make_shared<state>();
+	/* last, so that it goes first: waits for a running callback */
+	std::optional<std::stop_callback<waker>> stop_;
+};
+
+/*
+ *	Policies for basic_lockfile. Each one contributes flags that are
+ *	known at compile time; combinations that lockfile_handle_init()
+ *	would refuse don't compile.
+ *
+ *	Backoff: how long to sleep between retries.
+ */
+template<class P>
+concept lock_policy = requires {
+	{ P::flags } -> std::convertible_to<int>;
+};
+
+template<class P>
+concept backoff_policy = lock_policy<P> && requires(__lockargs &a) {
+	P::setup(a);
+};
+
+template<class P>
+concept liveness_policy = lock_policy<P> && requires {
+	{ P::refresh } -> std::convertible_to<bool>;
+};
+
+/* 5, 10, 15 .. 60 seconds, like lockfile_create() */
+struct classic_backoff {
+	static constexpr int flags = 0;
+	static void setup(__lockargs &) noexcept {}
+};
+
+template<int Seconds>
+struct fixed_backoff {
+	static_assert(Seconds > 0, "fixed_backoff needs a positive interval");
+	static constexpr int flags = __L_INTERVAL;
+	static void setup(__lockargs &a) noexcept { a.interval = Seconds; }
+};
+
+/* L_ADAPTIVE: retry around the hold time seen so far */
+struct adaptive_backoff {
+	static constexpr int flags = __L_ADAPTIVE;
+	static void setup(__lockargs &) noexcept {}
+};
+
+/*
+ *	Liveness: what goes into the lockfile, and how others decide
+ *	that its holder is gone. With "refresh", only the age of the
+ *	lockfile counts, and the holder must touch() it well within
+ *	5 minutes.
+ */
+struct pid_liveness {
+	static constexpr int flags = L_PID;
+	static constexpr bool refresh = false;
+};
+
+struct ppid_liveness {
+	static constexpr int flags = L_PPID;
+	static constexpr bool refresh = false;
+};
+
+/* L_HOLDFD: held for as long as the holder fd is open */
+struct lease_liveness {
+	static constexpr int flags = L_PID | __L_HOLDFD;
+	static constexpr bool refresh = false;
+};
+
+struct mtime_liveness {
+	static constexpr int flags = 0;
+	static constexpr bool refresh = true;
+};
+
+/*
+ *	Strategy: how the lock is taken.
+ */
+struct link_strategy {
+	static constexpr int flags = 0;
+};
+
+/* L_PROBE: stat() the lockfile before making a temp file */
+struct probe_strategy {
+	static constexpr int flags = __L_PROBE;
+};
+
+/* L_BOARD: wait on the shared-memory board */
+struct board_strategy {
+	static constexpr int flags = __L_BOARD;
+};
+
+/* L_THREAD: threads of this process queue in-process first */
+struct thread_strategy {
+	static constexpr int flags = __L_THREAD;
+};
+
+/* L_ABSTRACT: host-local lock on an abstract Unix socket */
+struct socket_strategy {
+	static constexpr int flags = __L_ABSTRACT;
+};
+
+/*
+ *	A lock with its policies fixed at compile time, on top of the
+ *	lock handle. Flags are checked once, in the constructor, and
+ *	nothing allocates memory after that. It satisfies Lockable, so
+ *	it works with std::lock_guard and std::unique_lock. Not movable:
+ *	the C library may keep a pointer to the handle.
+ */
+template<backoff_policy Backoff = classic_backoff,
+	 liveness_policy Liveness = pid_liveness,
+	 lock_policy Strategy = link_strategy>
+class basic_lockfile {
+public:
+	static constexpr int flags =
+		Backoff::flags | Liveness::flags | Strategy::flags;
+
+	static_assert(!(flags & __L_ABSTRACT) ||
+		!(flags & (__L_HOLDFD|__L_THREAD)),
+		"socket_strategy can't be combined with lease_liveness");
+	static_assert(!(flags & __L_ABSTRACT) || !Liveness::refresh,
+		"socket locks have no lockfile to refresh");
+	static_assert(!(flags & __L_THREAD) || !(flags & __L_HOLDFD),
+		"thread_strategy can't be combined with lease_liveness");
+
+	explicit basic_lockfile(const std::string &path)
+	{
+		std::error_code ec = init(path);
+		if (ec)
+			throw std::system_error(ec, path);
+	}
+	basic_lockfile(const std::string &path, std::error_code &ec) noexcept
+	{
+		ec = init(path);
+	}
+	basic_lockfile(const basic_lockfile &) = delete;
+	basic_lockfile &operator=(const basic_lockfile &) = delete;
+	~basic_lockfile() { lockfile_handle_close(&h_); }
+
+	/* like lockfile_create(): give up after "retries" retries */
+	std::error_code lock(int retries) noexcept
+	{
+		int r = lockfile_handle_acquire(&h_, retries);
+
+		return make_error_code(r, errno);
+	}
+
+	void lock()
+	{
+		std::error_code ec;
+
+		while (contended(ec = lock(INT_MAX - 1)))
+			;
+		if (ec)
+			throw std::system_error(ec, path());
+	}
+
+	bool try_lock()
+	{
+		std::error_code ec = lock(0);
+
+		if (contended(ec))
+			return false;
+		if (ec)
+			throw std::system_error(ec, path());
+		return true;
+	}
+
+	void unlock() noexcept { lockfile_handle_release(&h_); }
+
+	std::error_code touch() noexcept
+	{
+		if constexpr ((flags & __L_ABSTRACT) != 0) {
+			return {};
+		} else {
+			if (lockfile_handle_touch(&h_) < 0)
+				return std::error_code(errno,
+					std::generic_category());
+			return {};
+		}
+	}
+
+	bool owns_lock() const noexcept { return h_.locked; }
+	const char *path() const noexcept { return h_.lockfile; }
+
+	/* holder fd with lease_liveness, -1 otherwise */
+	int fd() const noexcept
+	{
+		if constexpr ((flags & __L_HOLDFD) != 0)
+			return h_.args.fd;
+		else
+			return -1;
+	}
+
+	/* is "path" held, judged the way this kind of lock is? */
+	static bool held(const std::string &path) noexcept
+	{
+		return lockfile_check(path.c_str(),
+			flags & (L_PID|L_PPID|__L_ABSTRACT)) == 0;
+	}
+
+private:
+	std::error_code init(const std::string &path) noexcept
+	{
+		int r = lockfile_handle_init(&h_, path.c_str(), flags);
+		int e = errno;
+
+		Backoff::setup(h_.args);
+		return make_error_code(r, e);
+	}
+
+	lockfile_handle		h_;
+};
+
+} /* namespace lockfile */
+
+#endif /* _LOCKFILE_HPP */
@@ -0,0 +1,393 @@
+/*
+ * lockstress.c	Stress test for lockfile_create() and lockfile_check().
+ *		Runs lots of concurrent lockers through randomized
+ *		lock/unlock/crash/stale cycles and checks that no two
+ *		processes ever hold the same lock. With -D every
+ *		cycle takes two locks, in random order, with L_WAITFOR.
+ *
+ *		It is linked against a test build of lockfile.c
+ *		(-DLOCKFILE_TEST), where the clock and the sleep between
+ *		retries can be replaced: one second of backoff becomes
+ *		one millisecond, and stale locks are aged by moving a
+ *		shared virtual clock forward instead of waiting 5 minutes.
+ *
+ *		Copyright (C) Miquel van Smoorenburg and contributors 1999-2021
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version 2
+ *		of the License, or (at your option) any later version.
+ */
+
+#include "autoconf.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#define LOCKFILE_EXPERIMENTAL
+#include <lockfile.h>
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#define MAXLOCKS	64
+#define HISTSZ		32
+
+extern time_t	(*lockfile_test_time)(time_t *);
+extern void	(*lockfile_test_sleep)(long ms);
+
+/*
+ *	Shared between all lockers.
+ */
+struct shared {
+	long	skew;			/* added to time(), in seconds	*/
+	int	holders[MAXLOCKS];	/* must never be more than 1	*/
+	long	acquired;
+	long	failed;
+	long	crashes;
+	long	stale;
+	long	violations;
+	long	deadlocks;
+	long	lat_sum;		/* latency, usecs		*/
+	long	lat_max;
+	long	hist[HISTSZ];		/* log2(usecs)			*/
+};
+
+static struct shared	*sh;
+static char		locks[MAXLOCKS][256];
+static int		nlocks = 4;
+static int		retries = 100000;
+static int		usec_per_sec = 1000;
+static int		hold_us = 200;
+static int		crash_pct = 2;
+static int		stale_pct = 2;
+static int		quiet;
+static int		xflags;
+static int		twolocks;		/* -D: take two, find deadlocks	*/
+static char		table[256];		/* -T: lock table file		*/
+
+static time_t vtime(time_t *t)
+{
+	time_t	now = time(NULL) + __atomic_load_n(&sh->skew, __ATOMIC_RELAXED);
+
+	if (t)
+		*t = now;
+	return now;
+}
+
+static void vsleep(long ms)
+{
+	usleep(ms * usec_per_sec / 1000);
+}
+
+/*
+ *	xorshift32, so the schedule depends on the seed only.
+ */
+static unsigned int rnd(unsigned int *s)
+{
+	unsigned int	x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *s = x;
+}
+
+static long now_us(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void add(long *p, long v)
+{
+	__atomic_add_fetch(p, v, __ATOMIC_RELAXED);
+}
+
+/*
+ *	Take a lock, and record how long it took.
+ */
+static int take(int k, int flags)
+{
+	struct lockargs	args;
+	long		t, max;
+	int		b, r;
+
+	memset(&args, 0, sizeof(args));
+	t = now_us();
+	r = table[0] ? lockfile_table_create(table, locks[k], retries, flags) :
+		lockfile_create2(locks[k], retries, flags | xflags,
+			&args, sizeof(args));
+	if (r != L_SUCCESS) {
+		add(r == L_DEADLOCK ? &sh->deadlocks : &sh->failed, 1);
+		return -1;
+	}
+	t = now_us() - t;
+	add(&sh->acquired, 1);
+	add(&sh->lat_sum, t);
+	max = __atomic_load_n(&sh->lat_max, __ATOMIC_RELAXED);
+	while (t > max && !__atomic_compare_exchange_n(&sh->lat_max,
+			&max, t, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	for (b = 0; t > 1 && b < HISTSZ - 1; b++)
+		t >>= 1;
+	add(&sh->hist[b], 1);
+	return 0;
+}
+
+/*
+ *	The critical section.
+ */
+static void hold(int k, unsigned int *seed)
+{
+	if (__atomic_add_fetch(&sh->holders[k], 1, __ATOMIC_SEQ_CST) != 1)
+		add(&sh->violations, 1);
+	if (hold_us > 0)
+		usleep(rnd(seed) % hold_us);
+	__atomic_sub_fetch(&sh->holders[k], 1, __ATOMIC_SEQ_CST);
+}
+
+static void locker(unsigned int seed, int cycles)
+{
+	pid_t	pid;
+	int	i, k, k2, what, fd;
+
+	for (i = 0; i < cycles; i++) {
+		k = rnd(&seed) % nlocks;
+		what = rnd(&seed) % 100;
+		if (twolocks) {
+			/*
+			 *	Hold one lock while waiting for another.
+			 *	The victim of a deadlock lets go of the
+			 *	first one, so that the others can go on.
+			 */
+			k2 = (k + 1 + rnd(&seed) % (nlocks - 1)) % nlocks;
+			if (take(k, L_PID) == 0) {
+				hold(k, &seed);
+				if (take(k2, L_PID) == 0) {
+					hold(k2, &seed);
+					lockfile_remove(locks[k2]);
+				}
+				lockfile_remove(locks[k]);
+			}
+		} else if (what < crash_pct) {
+			/*
+			 *	Crash while holding the lock: the lockfile
+			 *	stays behind with the pid of a dead process.
+			 */
+			add(&sh->crashes, 1);
+			if ((pid = fork()) == 0) {
+				if (take(k, L_PID) == 0)
+					hold(k, &seed);
+				_exit(0);
+			}
+			while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+				;
+		} else if (what < crash_pct + stale_pct && !table[0] &&
+			   !(xflags & L_LOCAL)) {
+			/*
+			 *	Leave a lockfile without a pid behind, and
+			 *	age it by moving the clock 5 minutes ahead.
+			 *	Table locks can't go stale, only crash, and
+			 *	with L_LOCAL a live process keeps its turn.
+			 */
+			add(&sh->stale, 1);
+			if (take(k, L_PID) == 0) {
+				hold(k, &seed);
+				if ((fd = open(locks[k], O_WRONLY|O_TRUNC)) >= 0) {
+					(void)!write(fd, "0\n", 2);
+					close(fd);
+				}
+				add(&sh->skew, 301);
+			}
+		} else {
+			if (take(k, L_PID) == 0) {
+				hold(k, &seed);
+				if (table[0])
+					lockfile_table_remove(table, locks[k]);
+				else
+					lockfile_remove(locks[k]);
+			}
+		}
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lockstress [-n lockers] [-c cycles] [-l locks] [-s seed]\n");
+	fprintf(stderr, "                  [-u usecs_per_sec] [-h hold_usecs] [-C crash%%]\n");
+	fprintf(stderr, "                  [-S stale%%] [-d dir] [-P] [-B] [-A] [-T] [-D] [-L] [-q]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char		tmpdir[] = "/tmp/lockstressXXXXXX";
+	char		*dir = NULL;
+	unsigned int	seed = 1;
+	long		t, total, n;
+	int		lockers = 200;
+	int		cycles = 50;
+	int		c, i, b, p50 = 0, p99 = 0, bad;
+
+	while ((c = getopt(argc, argv, "n:c:l:s:u:h:C:S:d:PBATDLq")) != EOF) switch(c) {
+		case 'n':
+			lockers = atoi(optarg);
+			break;
+		case 'c':
+			cycles = atoi(optarg);
+			break;
+		case 'l':
+			nlocks = atoi(optarg);
+			if (nlocks < 1 || nlocks > MAXLOCKS)
+				usage();
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			usec_per_sec = atoi(optarg);
+			break;
+		case 'h':
+			hold_us = atoi(optarg);
+			break;
+		case 'C':
+			crash_pct = atoi(optarg);
+			break;
+		case 'S':
+			stale_pct = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'P':
+			xflags |= L_PROBE;
+			break;
+		case 'B':
+			xflags |= L_BOARD;
+			break;
+		case 'A':
+			xflags |= L_ADAPTIVE;
+			break;
+		case 'T':
+			table[0] = 1;
+			break;
+		case 'L':
+			xflags |= L_LOCAL;
+			break;
+		case 'D':
+			twolocks = 1;
+			xflags |= L_WAITFOR;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage();
+	}
+	if (lockers < 1 || cycles < 1 || (twolocks && (nlocks < 2 || table[0])))
+		usage();
+
+	if (dir == NULL && (dir = mkdtemp(tmpdir)) == NULL) {
+		perror("lockstress: mkdtemp");
+		return 1;
+	}
+	for (i = 0; i < nlocks; i++) {
+		snprintf(locks[i], sizeof(locks[i]), "%s/stress%d.lock", dir, i);
+		unlink(locks[i]);
+	}
+	if (table[0]) {
+		/* a small table, so that names share buckets */
+		snprintf(table, sizeof(table), "%s/stress.table", dir);
+		unlink(table);
+		if (lockfile_table_init(table, 2) != 0) {
+			perror("lockstress: lockfile_table_init");
+			return 1;
+		}
+	}
+
+	sh = mmap(NULL, sizeof(*sh), PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) {
+		perror("lockstress: mmap");
+		return 1;
+	}
+	lockfile_test_time = vtime;
+	lockfile_test_sleep = vsleep;
+
+	/*
+	 *	With L_ADAPTIVE, take every lock once before forking,
+	 *	so all lockers start out with an estimate.
+	 */
+	for (i = 0; (xflags & L_ADAPTIVE) && i < nlocks; i++) {
+		if (lockfile_create2(locks[i], 0, L_PID | xflags,
+				NULL, 0) == L_SUCCESS) {
+			usleep(hold_us / 2);
+			lockfile_remove(locks[i]);
+		}
+	}
+
+	t = now_us();
+	for (i = 0; i < lockers; i++) {
+		switch (fork()) {
+		case -1:
+			perror("lockstress: fork");
+			return 1;
+		case 0:
+			locker(seed * 2654435761u + i + 1, cycles);
+			_exit(0);
+		}
+	}
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	t = now_us() - t;
+
+	for (i = 0; i < nlocks; i++)
+		unlink(locks[i]);
+	if (table[0])
+		unlink(table);
+	if (dir == tmpdir)
+		rmdir(dir);
+
+	total = sh->acquired ? sh->acquired : 1;
+	for (n = 0, b = 0; b < HISTSZ; b++) {
+		n += sh->hist[b];
+		if (!p50 && n * 2 >= total)
+			p50 = b + 1;
+		if (!p99 && n * 100 >= total * 99)
+			p99 = b + 1;
+	}
+	/*
+	 *	With -D, the two locks are taken in random order by many
+	 *	lockers: if no deadlock was ever found, detection is broken.
+	 */
+	bad = sh->violations || sh->failed || (twolocks && !sh->deadlocks);
+	if (!quiet || bad) {
+		printf("lockers %d, cycles %d, locks %d, seed %u\n",
+			lockers, cycles, nlocks, seed);
+		printf("acquired %ld, failed %ld, crashes %ld, stale %ld\n",
+			sh->acquired, sh->failed, sh->crashes, sh->stale);
+		printf("elapsed %.2fs, %.0f locks/s\n",
+			t / 1e6, sh->acquired / (t / 1e6));
+		printf("latency avg %ldus, p50 < %ldus, p99 < %ldus, max %ldus\n",
+			sh->lat_sum / total, 1L << p50, 1L << p99, sh->lat_max);
+		if (twolocks)
+			printf("deadlocks broken %ld\n", sh->deadlocks);
+		printf("mutual exclusion violations: %ld\n", sh->violations);
+	}
+
+	if (twolocks && !sh->deadlocks)
+		fprintf(stderr, "lockstress: -D found no deadlocks\n");
+	return bad ? 1 : 0;
+}
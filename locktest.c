@@ -0,0 +1,522 @@
+/*
+ * locktest.c	Small checks of library features that dotlockfile has
+ *		no option for, run from run-tests.sh:
+ *
+ *		locktest thread <lockfile>	L_THREAD and L_RECURSIVE
+ *		locktest ns <directory>		lockfile_ns_*()
+ *		locktest durable <lockfile>	L_NOCONTENT, L_SYNC, L_SYNCDIR
+ *		locktest maillock <mailbox>	maillock2() with ML_FCNTL
+ *		locktest holdfd <lockfile>	L_HOLDFD
+ *		locktest pidreuse <lockfile>	start= and pidns= lines
+ *		locktest keeptmp <lockfile>	L_KEEPTMP
+ *		locktest excl <file>		open(O_EXCL), for nfslock.so
+ *
+ *		Exits 0 if all is well, otherwise prints what went
+ *		wrong and exits 1.
+ *
+ *		Copyright (C) Miquel van Smoorenburg and contributors 1999-2021
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version 2
+ *		of the License, or (at your option) any later version.
+ */
+
+#include "autoconf.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <utime.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#define LOCKFILE_EXPERIMENTAL
+#include <lockfile.h>
+#include <maillock.h>
+
+static const char	*progname = "locktest";
+static int		failed;
+
+#define CHECK(cond)	check(cond, #cond, __LINE__)
+
+static void check(int ok, const char *what, int line)
+{
+	if (!ok) {
+		fprintf(stderr, "%s: line %d: %s failed\n",
+			progname, line, what);
+		failed = 1;
+	}
+}
+
+static int exists(const char *file)
+{
+	struct stat	st;
+
+	return stat(file, &st) == 0;
+}
+
+static int create(const char *lockfile, int retries, int flags)
+{
+	return lockfile_create2(lockfile, retries, flags, NULL, 0);
+}
+
+/*
+ *	L_THREAD: a second thread waits in memory and gets the
+ *	lockfile handed over, without it ever going away.
+ */
+static int	thread_result = -1;
+static int	thread_saw_file;
+
+static void *thread_locker(void *arg)
+{
+	const char	*lockfile = arg;
+
+	thread_result = create(lockfile, 5, L_THREAD);
+	thread_saw_file = exists(lockfile);
+	if (thread_result == 0)
+		lockfile_remove(lockfile);
+	return NULL;
+}
+
+static void test_thread(const char *lockfile)
+{
+	pthread_t	t;
+
+	CHECK(create(lockfile, 0, L_THREAD) == 0);
+	/* taking it again from the same thread is a deadlock */
+	CHECK(create(lockfile, 0, L_THREAD) == L_ERROR && errno == EDEADLK);
+
+	CHECK(pthread_create(&t, NULL, thread_locker, (void *)lockfile) == 0);
+	poll(NULL, 0, 200);
+	CHECK(thread_result == -1);
+	CHECK(lockfile_remove(lockfile) == 0);
+	pthread_join(t, NULL);
+	CHECK(thread_result == 0);
+	CHECK(thread_saw_file);
+	CHECK(!exists(lockfile));
+
+	/* L_RECURSIVE: every create needs a remove */
+	CHECK(create(lockfile, 0, L_THREAD|L_RECURSIVE) == 0);
+	CHECK(create(lockfile, 0, L_THREAD|L_RECURSIVE) == 0);
+	CHECK(lockfile_remove(lockfile) == 0);
+	CHECK(exists(lockfile));
+	CHECK(lockfile_remove(lockfile) == 0);
+	CHECK(!exists(lockfile));
+}
+
+/*
+ *	Sharded namespace: root/xx/yy/name.lock, directories
+ *	created on first use.
+ */
+static void test_ns(const char *root)
+{
+	char	path[4096], *p;
+
+	CHECK(lockfile_ns_name(root, "mbox", path, sizeof(path)) == 0);
+	CHECK(strncmp(path, root, strlen(root)) == 0);
+	p = path + strlen(root);
+	CHECK(strlen(p) == strlen("/xx/yy/mbox.lock") &&
+	      p[0] == '/' && p[3] == '/' && p[6] == '/' &&
+	      strcmp(p + 7, "mbox.lock") == 0);
+
+	CHECK(lockfile_ns_create(root, "mbox", 0, L_PID) == 0);
+	CHECK(exists(path));
+	CHECK(lockfile_ns_check(root, "mbox", 0) == 0);
+	CHECK(lockfile_ns_create(root, "mbox", 0, L_PID) == L_MAXTRYS);
+	CHECK(lockfile_ns_touch(root, "mbox") == 0);
+	CHECK(lockfile_ns_remove(root, "mbox") == 0);
+	CHECK(!exists(path));
+	CHECK(lockfile_ns_check(root, "mbox", 0) < 0);
+
+	/* a name is one path component */
+	CHECK(lockfile_ns_name(root, "a/b", path, sizeof(path)) == L_ERROR &&
+	      errno == EINVAL);
+	CHECK(lockfile_ns_name(root, "..", path, sizeof(path)) == L_ERROR);
+	CHECK(lockfile_ns_name(root, "mbox", path, 8) == L_NAMELEN);
+}
+
+/*
+ *	Durability levels.
+ */
+static void test_durable(const char *lockfile)
+{
+	struct stat	st;
+	char		name[33][4096];
+	int		i;
+
+	CHECK(create(lockfile, 0, L_DURABLE_NONE) == 0);
+	CHECK(stat(lockfile, &st) == 0 && st.st_size == 0);
+	CHECK(lockfile_check(lockfile, 0) == 0);
+	CHECK(lockfile_remove(lockfile) == 0);
+
+	CHECK(create(lockfile, 0, L_PID|L_DURABLE_CONTENT) == 0);
+	CHECK(stat(lockfile, &st) == 0 && st.st_size > 0);
+	CHECK(lockfile_check(lockfile, 0) == 0);
+	CHECK(lockfile_remove(lockfile) == 0);
+
+	CHECK(create(lockfile, 0, L_PID|L_DURABLE_FULL) == 0);
+	CHECK(lockfile_check(lockfile, 0) == 0);
+	CHECK(lockfile_remove(lockfile) == 0);
+	CHECK(!exists(lockfile));
+
+	/* nothing to check the pid against, or no dir sync on handoff */
+	CHECK(create(lockfile, 0, L_PID|L_NOCONTENT) == L_ERROR &&
+	      errno == EINVAL);
+	CHECK(create(lockfile, 0, L_THREAD|L_SYNCDIR) == L_ERROR &&
+	      errno == EINVAL);
+	CHECK(!exists(lockfile));
+
+	/* no more than 32 locks to sync on remove: the next one fails */
+	for (i = 0; i < 33; i++) {
+		snprintf(name[i], sizeof(name[i]), "%s.%d", lockfile, i);
+		if (i < 32)
+			CHECK(create(name[i], 0, L_SYNCDIR) == 0);
+	}
+	CHECK(create(name[32], 0, L_SYNCDIR) == L_ERROR && errno == ENOLCK);
+	CHECK(!exists(name[32]));
+	for (i = 0; i < 32; i++)
+		CHECK(lockfile_remove(name[i]) == 0);
+	CHECK(create(name[32], 0, L_SYNCDIR) == 0);
+	CHECK(lockfile_remove(name[32]) == 0 && !exists(name[32]));
+}
+
+#ifdef F_OFD_SETLK
+/*
+ *	maillock2() with ML_FCNTL: the dotlock and a kernel lock on the
+ *	mailbox. Another open file description stands in for a mail
+ *	reader that only uses fcntl().
+ */
+static int	mbox_fd = -1;
+
+static int mbox_lock(const char *mbox)
+{
+	struct flock	fl;
+	int		fd;
+
+	if ((fd = open(mbox, O_RDWR)) < 0)
+		return -1;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	if (fcntl(fd, F_OFD_SETLK, &fl) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int mbox_busy(const char *mbox)
+{
+	int	fd;
+
+	if ((fd = mbox_lock(mbox)) < 0)
+		return 1;
+	close(fd);
+	return 0;
+}
+
+static void *mbox_unlocker(void *arg)
+{
+	(void)arg;
+	poll(NULL, 0, 300);
+	close(mbox_fd);
+	return NULL;
+}
+
+static void test_maillock(const char *mbox)
+{
+	char		lockfile[4096];
+	const char	*name;
+	pthread_t	t;
+	time_t		start;
+	int		fd;
+
+	name = strrchr(mbox, '/') ? strrchr(mbox, '/') + 1 : mbox;
+	snprintf(lockfile, sizeof(lockfile), "%s.lock", mbox);
+	setenv("MAIL", mbox, 1);
+	CHECK((fd = open(mbox, O_WRONLY|O_CREAT, 0600)) >= 0);
+	close(fd);
+
+	CHECK(maillock2(name, 0, ML_FCNTL) == 0);
+	CHECK(exists(lockfile));
+	CHECK(mbox_busy(mbox));
+	mailunlock();
+	CHECK(!exists(lockfile));
+	CHECK(!mbox_busy(mbox));
+
+	/* the mailbox is locked: give up, and don't keep the dotlock */
+	CHECK((mbox_fd = mbox_lock(mbox)) >= 0);
+	CHECK(maillock2(name, 0, ML_FCNTL) == L_MAXTRYS && errno == EAGAIN);
+	CHECK(!exists(lockfile));
+
+	/* with a retry, wait for it in the kernel, not for 5 seconds */
+	CHECK(pthread_create(&t, NULL, mbox_unlocker, NULL) == 0);
+	start = time(NULL);
+	CHECK(maillock2(name, 1, ML_FCNTL) == 0);
+	CHECK(time(NULL) - start < 5);
+	pthread_join(t, NULL);
+	CHECK(exists(lockfile) && mbox_busy(mbox));
+	mailunlock();
+	CHECK(!exists(lockfile) && !mbox_busy(mbox));
+	unlink(mbox);
+}
+#else
+static void test_maillock(const char *mbox)
+{
+	(void)mbox;
+}
+#endif
+
+#ifdef F_OFD_SETLK
+/*
+ *	L_HOLDFD: the lock lives as long as the descriptor, whatever
+ *	the pid in the lockfile says. The child writes our pid
+ *	(L_PPID), which stays alive after the child has been killed.
+ */
+static void test_holdfd(const char *lockfile)
+{
+	struct __lockargs	args;
+	pid_t			pid;
+	char			c;
+	int			p[2];
+
+	CHECK(pipe(p) == 0);
+	if ((pid = fork()) == 0) {
+		if (lockfile_create2(lockfile, 0, L_PPID|L_HOLDFD,
+				&args, sizeof(args)) == 0 && args.fd >= 0)
+			(void)!write(p[1], "x", 1);
+		pause();
+		_exit(0);
+	}
+	close(p[1]);
+	CHECK(read(p[0], &c, 1) == 1);
+	close(p[0]);
+	CHECK(lockfile_check(lockfile, L_PID) == 0);
+	CHECK(create(lockfile, 0, L_PID) == L_MAXTRYS);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	CHECK(lockfile_check(lockfile, L_PID) < 0);
+	CHECK(create(lockfile, 0, L_PID) == 0);
+	CHECK(lockfile_remove(lockfile) == 0);
+
+	/* the descriptor is what counts, not the process */
+	CHECK(lockfile_create2(lockfile, 0, L_PID|L_HOLDFD,
+			&args, sizeof(args)) == 0 && args.fd >= 0);
+	if ((pid = fork()) == 0) {
+		pause();
+		_exit(0);
+	}
+	close(args.fd);
+	CHECK(lockfile_check(lockfile, L_PID) == 0);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	CHECK(lockfile_check(lockfile, L_PID) < 0);
+	CHECK(lockfile_remove(lockfile) == 0);
+}
+#else
+static void test_holdfd(const char *lockfile)
+{
+	(void)lockfile;
+}
+#endif
+
+#ifdef __linux__
+/*
+ *	Write a lockfile by hand, dated "age" seconds ago.
+ */
+static void write_lock(const char *lockfile, const char *text, int age)
+{
+	struct utimbuf	ut;
+	int		fd;
+
+	CHECK((fd = open(lockfile, O_WRONLY|O_CREAT|O_TRUNC, 0644)) >= 0);
+	CHECK(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+	close(fd);
+	ut.actime = ut.modtime = time(NULL) - age;
+	CHECK(utime(lockfile, &ut) == 0);
+}
+
+/*
+ *	A live pid that started at another time than the lockfile
+ *	says is a reused one; a pid of another pid namespace can't
+ *	be checked, so only the mtime counts.
+ */
+static void test_pidreuse(const char *lockfile)
+{
+	char			buf[256], text[256];
+	unsigned long long	start = 0;
+	unsigned long		pidns = 0;
+	char			*p;
+	int			fd, n = 0;
+
+	CHECK(create(lockfile, 0, L_PID) == 0);
+	CHECK((fd = open(lockfile, O_RDONLY)) >= 0);
+	CHECK((n = read(fd, buf, sizeof(buf) - 1)) > 0);
+	close(fd);
+	buf[n > 0 ? n : 0] = 0;
+	CHECK(atoi(buf) == (int)getpid());
+	CHECK((p = strstr(buf, "\nstart=")) != NULL &&
+	      (start = strtoull(p + 7, NULL, 10)) != 0);
+	CHECK((p = strstr(buf, "\npidns=")) != NULL &&
+	      (pidns = strtoul(p + 7, NULL, 10)) != 0);
+	CHECK(lockfile_check(lockfile, L_PID) == 0);
+
+	/* our pid, but we started at another time: stale */
+	snprintf(text, sizeof(text), "%d\nstart=%llu\npidns=%lu\n",
+		(int)getpid(), start + 1, pidns);
+	write_lock(lockfile, text, 0);
+	CHECK(lockfile_check(lockfile, L_PID) < 0);
+	CHECK(create(lockfile, 0, L_PID) == 0);
+
+	/* without the line, as written by older versions: held */
+	snprintf(text, sizeof(text), "%d\n", (int)getpid());
+	write_lock(lockfile, text, 0);
+	CHECK(lockfile_check(lockfile, L_PID) == 0);
+
+	/* another pid namespace: held while it is fresh, whatever the pid */
+	snprintf(text, sizeof(text), "%d\nstart=%llu\npidns=%lu\n",
+		(int)getpid(), start + 1, pidns + 1);
+	write_lock(lockfile, text, 0);
+	CHECK(lockfile_check(lockfile, L_PID) == 0);
+	write_lock(lockfile, text, 600);
+	CHECK(lockfile_check(lockfile, L_PID) < 0);
+	CHECK(lockfile_remove(lockfile) == 0);
+}
+#else
+static void test_pidreuse(const char *lockfile)
+{
+	(void)lockfile;
+}
+#endif
+
+/*
+ *	L_KEEPTMP: one temp file for all acquisitions of a handle,
+ *	removed when the handle is closed or the process exits.
+ */
+static struct lockfile_handle	keep_h;
+
+static void test_keeptmp(const char *lockfile)
+{
+	struct stat	st, st1;
+	char		tmp[sizeof(keep_h.tmplock)];
+	pid_t		pid;
+	int		p[2], n;
+
+	CHECK(lockfile_handle_init(&keep_h, lockfile,
+			L_PID|L_KEEPTMP|L_HOLDFD) == L_ERROR &&
+	      errno == EINVAL);
+	CHECK(lockfile_handle_init(&keep_h, lockfile, L_PID|L_KEEPTMP) == 0);
+	CHECK(lockfile_handle_acquire(&keep_h, 0) == 0);
+	strcpy(tmp, keep_h.tmplock);
+	CHECK(lstat(tmp, &st) == 0 && st.st_nlink == 2);
+	CHECK(lstat(lockfile, &st1) == 0 && st1.st_ino == st.st_ino);
+	CHECK(lockfile_check(lockfile, L_PID) == 0);
+	CHECK(lockfile_handle_release(&keep_h) == 0);
+	CHECK(!exists(lockfile));
+	CHECK(lstat(tmp, &st1) == 0 && st1.st_ino == st.st_ino &&
+	      st1.st_nlink == 1);
+
+	/* the same file again */
+	CHECK(lockfile_handle_acquire(&keep_h, 0) == 0);
+	CHECK(strcmp(keep_h.tmplock, tmp) == 0);
+	CHECK(lstat(lockfile, &st1) == 0 && st1.st_ino == st.st_ino);
+	CHECK(lockfile_handle_close(&keep_h) == 0);
+	CHECK(!exists(lockfile) && !exists(tmp));
+
+	/* a process that exits with the handle open leaves nothing */
+	CHECK(pipe(p) == 0);
+	if ((pid = fork()) == 0) {
+		if (lockfile_handle_init(&keep_h, lockfile,
+				L_PID|L_KEEPTMP) == 0 &&
+		    lockfile_handle_acquire(&keep_h, 0) == 0 &&
+		    lockfile_handle_release(&keep_h) == 0)
+			(void)!write(p[1], keep_h.tmplock,
+					strlen(keep_h.tmplock) + 1);
+		exit(0);
+	}
+	close(p[1]);
+	CHECK((n = read(p[0], tmp, sizeof(tmp) - 1)) > 0);
+	tmp[n > 0 ? n : 0] = 0;
+	close(p[0]);
+	waitpid(pid, NULL, 0);
+	CHECK(tmp[0] && !exists(tmp));
+	CHECK(!exists(lockfile));
+}
+
+/*
+ *	Exclusive creates, run under nfslocktest.so: every one
+ *	goes through a temp file and link(). With nfsfault.so
+ *	behind it losing the replies, the emulation must still
+ *	get each answer right, and leave no temp files behind.
+ */
+static void test_excl(const char *file)
+{
+	struct dirent	*de;
+	char		dir[4096], *p;
+	DIR		*d;
+	int		fd, fd2, i;
+
+	for (i = 0; i < 100; i++) {
+		CHECK((fd = open(file, O_WRONLY|O_CREAT|O_EXCL, 0644)) >= 0);
+		CHECK((fd2 = open(file, O_WRONLY|O_CREAT|O_EXCL, 0644)) < 0 &&
+		      errno == EEXIST);
+		if (fd2 >= 0)
+			close(fd2);
+		if (fd >= 0)
+			close(fd);
+		(void)unlink(file);
+	}
+	CHECK(!exists(file));
+
+	snprintf(dir, sizeof(dir), "%s", file);
+	if ((p = strrchr(dir, '/')) != NULL)
+		*p = 0;
+	else
+		strcpy(dir, ".");
+	CHECK((d = opendir(dir)) != NULL);
+	while (d && (de = readdir(d)) != NULL)
+		CHECK(strncmp(de->d_name, ".nfs", 4) != 0);
+	if (d)
+		closedir(d);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "Usage: locktest "
+			"thread|ns|durable|maillock|holdfd|pidreuse|keeptmp|"
+			"excl <path>\n");
+		return 1;
+	}
+	if (strcmp(argv[1], "thread") == 0)
+		test_thread(argv[2]);
+	else if (strcmp(argv[1], "ns") == 0)
+		test_ns(argv[2]);
+	else if (strcmp(argv[1], "durable") == 0)
+		test_durable(argv[2]);
+	else if (strcmp(argv[1], "maillock") == 0)
+		test_maillock(argv[2]);
+	else if (strcmp(argv[1], "holdfd") == 0)
+		test_holdfd(argv[2]);
+	else if (strcmp(argv[1], "pidreuse") == 0)
+		test_pidreuse(argv[2]);
+	else if (strcmp(argv[1], "keeptmp") == 0)
+		test_keeptmp(argv[2]);
+	else if (strcmp(argv[1], "excl") == 0)
+		test_excl(argv[2]);
+	else {
+		fprintf(stderr, "%s: unknown test %s\n", progname, argv[1]);
+		return 1;
+	}
+	return failed;
+}
@@ -0,0 +1,484 @@
+/*
+ * nfsfault.c	LD_PRELOAD shim that makes a local filesystem misbehave
+ *		the way NFS does, so that the code in lockfile.c that
+ *		deals with it can be tested without an NFS server:
+ *
+ *		lost=N	 N% of successful link() and unlink() calls report
+ *			 failure (EEXIST, ENOENT), as when the reply was
+ *			 lost and the retransmit failed.
+ *		lostopen=N the same for exclusive creates with open().
+ *		stale=N	 N% of stat()/lstat() calls return the attributes
+ *			 cached by an earlier call, if that is less than
+ *			 "ac" seconds old.
+ *		delay=N	 N% of stat()/lstat() calls of a name that didn't
+ *			 exist less than "ac" seconds ago still say ENOENT.
+ *		ac=S	 attribute cache timeout, default 3 seconds.
+ *		skew=S	 the server clock is S seconds ahead: all file
+ *			 times are moved, utime(NULL) sets the server time.
+ *		seed=N	 seed for the schedule.
+ *		dir=PATH only paths that start with PATH.
+ *		verbose	 log every fault, and print totals at exit.
+ *
+ *		NFSFAULT="seed=1,lost=5,stale=10" LD_PRELOAD=./nfsfault.so prog
+ *
+ *		Each process has its own schedule, made from the seed
+ *		and its pid, so a single process replays exactly.
+ *		Not thread-safe.
+ *
+ *		Copyright (C) Miquel van Smoorenburg and contributors 1999-2021
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version 2
+ *		of the License, or (at your option) any later version.
+ */
+
+#include "autoconf.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <time.h>
+#include <errno.h>
+
+#ifndef __linux__
+#  error This is really only meant for Linux systems, sorry.
+#endif
+
+#define NCACHE		64
+#define PATHSZ		256
+
+#define F_LOST		0
+#define F_STALE		1
+#define F_DELAY		2
+#define F_SKEW		3
+
+static const char *fname[] = { "lost reply", "stale attrs", "delayed", "skew" };
+
+static struct {
+	int		init;
+	unsigned int	seed;
+	int		lost;
+	int		lostopen;
+	int		stale;
+	int		delay;
+	int		ac;
+	int		skew;
+	int		verbose;
+	char		dir[PATHSZ];
+	size_t		dirlen;
+} cf;
+
+/*
+ *	What a stat() of a name returned last time.
+ */
+static struct centry {
+	char		path[PATHSZ];
+	int		lnk;
+	int		err;
+	time_t		when;
+	struct stat64	st;
+} cache[NCACHE];
+
+static unsigned int	rstate;
+static pid_t		rpid;
+static unsigned long	nfaults[4];
+
+static void report(void)
+{
+	fprintf(stderr, "nfsfault[%d]: %lu lost, %lu stale, %lu delayed\n",
+		(int)getpid(), nfaults[F_LOST], nfaults[F_STALE],
+		nfaults[F_DELAY]);
+}
+
+static void setup(void)
+{
+	char	*env, *s, *opt;
+
+	if (cf.init)
+		return;
+	cf.init = 1;
+	cf.seed = 1;
+	cf.ac = 3;
+	if ((env = getenv("NFSFAULT")) == NULL || (env = strdup(env)) == NULL)
+		return;
+	for (opt = strtok_r(env, ",", &s); opt; opt = strtok_r(NULL, ",", &s)) {
+		if (strncmp(opt, "seed=", 5) == 0)
+			cf.seed = strtoul(opt + 5, NULL, 0);
+		else if (strncmp(opt, "lost=", 5) == 0)
+			cf.lost = atoi(opt + 5);
+		else if (strncmp(opt, "lostopen=", 9) == 0)
+			cf.lostopen = atoi(opt + 9);
+		else if (strncmp(opt, "stale=", 6) == 0)
+			cf.stale = atoi(opt + 6);
+		else if (strncmp(opt, "delay=", 6) == 0)
+			cf.delay = atoi(opt + 6);
+		else if (strncmp(opt, "ac=", 3) == 0)
+			cf.ac = atoi(opt + 3);
+		else if (strncmp(opt, "skew=", 5) == 0)
+			cf.skew = atoi(opt + 5);
+		else if (strncmp(opt, "dir=", 4) == 0) {
+			strncpy(cf.dir, opt + 4, sizeof(cf.dir) - 1);
+			cf.dirlen = strlen(cf.dir);
+		} else if (strcmp(opt, "verbose") == 0)
+			cf.verbose = 1;
+		else
+			fprintf(stderr, "nfsfault: unknown option %s\n", opt);
+	}
+	free(env);
+	if (cf.verbose)
+		atexit(report);
+}
+
+static void *real(const char *name)
+{
+	void	*fn = dlsym(RTLD_NEXT, name);
+
+	if (fn == NULL) {
+		fprintf(stderr, "nfsfault: %s not found\n", name);
+		abort();
+	}
+	return fn;
+}
+
+/*
+ *	Should this path be messed with at all?
+ */
+static int match(const char *path)
+{
+	setup();
+	if (path == NULL || strlen(path) >= PATHSZ)
+		return 0;
+	if (cf.dirlen)
+		return strncmp(path, cf.dir, cf.dirlen) == 0;
+	return strncmp(path, "/proc/", 6) != 0 &&
+	       strncmp(path, "/sys/", 5) != 0 &&
+	       strncmp(path, "/dev/", 5) != 0;
+}
+
+/*
+ *	Roll the dice for a fault of kind "f" with "pct" percent.
+ */
+static int roll(int f, int pct, const char *call, const char *path)
+{
+	pid_t		pid = getpid();
+	unsigned int	x;
+
+	if (pct <= 0)
+		return 0;
+	if (rpid != pid) {
+		rpid = pid;
+		rstate = (cf.seed ^ ((unsigned int)pid * 2654435761u)) | 1;
+	}
+	/* xorshift32 */
+	x = rstate;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rstate = x;
+	if (x % 100 >= (unsigned int)pct)
+		return 0;
+	nfaults[f]++;
+	if (cf.verbose)
+		fprintf(stderr, "nfsfault[%d]: %s on %s(%s)\n",
+			(int)pid, fname[f], call, path);
+	return 1;
+}
+
+static struct centry *lookup(const char *path, int lnk, int create)
+{
+	struct centry	*e, *old = NULL;
+	int		i;
+
+	for (i = 0; i < NCACHE; i++) {
+		e = &cache[i];
+		if (e->path[0] && e->lnk == lnk && strcmp(e->path, path) == 0)
+			return e;
+		if (old == NULL || e->when < old->when)
+			old = e;
+	}
+	if (!create)
+		return NULL;
+	strcpy(old->path, path);
+	old->lnk = lnk;
+	return old;
+}
+
+/*
+ *	Our own changes are visible to us right away.
+ */
+static void forget(const char *path)
+{
+	struct centry	*e;
+
+	if ((e = lookup(path, 0, 0)) != NULL)
+		e->path[0] = 0, e->when = 0;
+	if ((e = lookup(path, 1, 0)) != NULL)
+		e->path[0] = 0, e->when = 0;
+}
+
+static void skew(struct stat64 *st)
+{
+	st->st_atim.tv_sec += cf.skew;
+	st->st_mtim.tv_sec += cf.skew;
+	st->st_ctim.tv_sec += cf.skew;
+}
+
+/*
+ *	After a real stat() or lstat(): maybe return what the
+ *	attribute cache would have said instead.
+ */
+static int post_stat(const char *path, int lnk, int r, struct stat64 *st)
+{
+	const char	*call = lnk ? "lstat" : "stat";
+	struct centry	*e;
+	time_t		now;
+	int		err = errno;
+
+	if (!match(path))
+		return r;
+	time(&now);
+	e = lookup(path, lnk, 0);
+	if (e && now - e->when < cf.ac) {
+		if (e->err == 0 && roll(F_STALE, cf.stale, call, path)) {
+			*st = e->st;
+			skew(st);
+			errno = err;
+			return 0;
+		}
+		if (e->err == ENOENT && roll(F_DELAY, cf.delay, call, path)) {
+			errno = ENOENT;
+			return -1;
+		}
+	}
+	if (r == 0 || err == ENOENT) {
+		e = lookup(path, lnk, 1);
+		e->when = now;
+		e->err = r == 0 ? 0 : ENOENT;
+		if (r == 0)
+			e->st = *st;
+	}
+	if (r == 0)
+		skew(st);
+	errno = err;
+	return r;
+}
+
+#define COPYSTAT(d, s) do {				\
+	(d)->st_dev = (s)->st_dev;			\
+	(d)->st_ino = (s)->st_ino;			\
+	(d)->st_mode = (s)->st_mode;			\
+	(d)->st_nlink = (s)->st_nlink;			\
+	(d)->st_uid = (s)->st_uid;			\
+	(d)->st_gid = (s)->st_gid;			\
+	(d)->st_rdev = (s)->st_rdev;			\
+	(d)->st_size = (s)->st_size;			\
+	(d)->st_blksize = (s)->st_blksize;		\
+	(d)->st_blocks = (s)->st_blocks;		\
+	(d)->st_atim = (s)->st_atim;			\
+	(d)->st_mtim = (s)->st_mtim;			\
+	(d)->st_ctim = (s)->st_ctim;			\
+} while (0)
+
+/*
+ *	stat() and friends. glibc before 2.33 has the __xstat()
+ *	versions, newer ones the plain names.
+ */
+#define STATWRAP(name, type, lnk)					\
+int name(const char *path, type *buf)					\
+{									\
+	static int (*fn)(const char *, type *);				\
+	struct stat64	st;						\
+	int		r;						\
+									\
+	if (fn == NULL)							\
+		fn = real(#name);					\
+	r = fn(path, buf);						\
+	COPYSTAT(&st, buf);						\
+	r = post_stat(path, lnk, r, &st);				\
+	if (r == 0)							\
+		COPYSTAT(buf, &st);					\
+	return r;							\
+}
+
+#define XSTATWRAP(name, type, lnk)					\
+int name(int ver, const char *path, type *buf)				\
+{									\
+	static int (*fn)(int, const char *, type *);			\
+	struct stat64	st;						\
+	int		r;						\
+									\
+	if (fn == NULL)							\
+		fn = real(#name);					\
+	r = fn(ver, path, buf);						\
+	COPYSTAT(&st, buf);						\
+	r = post_stat(path, lnk, r, &st);				\
+	if (r == 0)							\
+		COPYSTAT(buf, &st);					\
+	return r;							\
+}
+
+#define FSTATWRAP(name, type)						\
+int name(int fd, type *buf)						\
+{									\
+	static int (*fn)(int, type *);					\
+	int		r;						\
+									\
+	if (fn == NULL)							\
+		fn = real(#name);					\
+	setup();							\
+	if ((r = fn(fd, buf)) == 0) {					\
+		buf->st_atim.tv_sec += cf.skew;				\
+		buf->st_mtim.tv_sec += cf.skew;				\
+		buf->st_ctim.tv_sec += cf.skew;				\
+	}								\
+	return r;							\
+}
+
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#undef stat
+#undef lstat
+#undef fstat
+STATWRAP(stat, struct stat, 0)
+STATWRAP(lstat, struct stat, 1)
+STATWRAP(stat64, struct stat64, 0)
+STATWRAP(lstat64, struct stat64, 1)
+FSTATWRAP(fstat, struct stat)
+FSTATWRAP(fstat64, struct stat64)
+#else
+XSTATWRAP(__xstat, struct stat, 0)
+XSTATWRAP(__lxstat, struct stat, 1)
+XSTATWRAP(__xstat64, struct stat64, 0)
+XSTATWRAP(__lxstat64, struct stat64, 1)
+#endif
+
+int link(const char *oldpath, const char *newpath)
+{
+	static int (*fn)(const char *, const char *);
+	int	r;
+
+	if (fn == NULL)
+		fn = real("link");
+	r = fn(oldpath, newpath);
+	if (!match(newpath))
+		return r;
+	forget(newpath);
+	if (r == 0 && roll(F_LOST, cf.lost, "link", newpath)) {
+		/* the retransmitted LINK finds the name taken */
+		errno = EEXIST;
+		return -1;
+	}
+	return r;
+}
+
+int unlink(const char *path)
+{
+	static int (*fn)(const char *);
+	int	r;
+
+	if (fn == NULL)
+		fn = real("unlink");
+	r = fn(path);
+	if (!match(path))
+		return r;
+	forget(path);
+	if (r == 0 && roll(F_LOST, cf.lost, "unlink", path)) {
+		errno = ENOENT;
+		return -1;
+	}
+	return r;
+}
+
+static int open_common(const char *name, const char *path, int flags,
+		mode_t mode)
+{
+	static int (*fn[2])(const char *, int, ...);
+	int	i = strcmp(name, "open64") == 0;
+	int	fd;
+
+	if (fn[i] == NULL)
+		fn[i] = real(name);
+	fd = fn[i](path, flags, mode);
+	if ((flags & (O_CREAT|O_EXCL)) != (O_CREAT|O_EXCL) || !match(path))
+		return fd;
+	forget(path);
+	if (fd >= 0 && roll(F_LOST, cf.lostopen, name, path)) {
+		/* created, but the retransmit says it exists */
+		close(fd);
+		errno = EEXIST;
+		return -1;
+	}
+	return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	va_list	ap;
+	mode_t	mode = 0;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return open_common("open", path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	va_list	ap;
+	mode_t	mode = 0;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return open_common("open64", path, flags, mode);
+}
+
+/*
+ *	Setting the time to "now" means the server's now.
+ */
+int utime(const char *path, const struct utimbuf *times)
+{
+	static int (*fn)(const char *, const struct utimbuf *);
+	struct utimbuf	ut;
+
+	if (fn == NULL)
+		fn = real("utime");
+	if (times == NULL && match(path) && cf.skew) {
+		ut.actime = ut.modtime = time(NULL) + cf.skew;
+		times = &ut;
+	}
+	if (match(path))
+		forget(path);
+	return fn(path, times);
+}
+
+int utimes(const char *path, const struct timeval tv[2])
+{
+	static int (*fn)(const char *, const struct timeval *);
+	struct timeval	now[2];
+
+	if (fn == NULL)
+		fn = real("utimes");
+	if (tv == NULL && match(path) && cf.skew) {
+		gettimeofday(&now[0], NULL);
+		now[0].tv_sec += cf.skew;
+		now[1] = now[0];
+		tv = now;
+	}
+	if (match(path))
+		forget(path);
+	return fn(path, tv);
+}
@@ -7,7 +7,7 @@
  *		put it in /lib as nfslock.so. Then add the line
  *		"/lib/nfslock.so" to /etc/ld.so.preload. That's all.
  *
- *		To compile: cc -fPIC -shared -o nfslock.so nfslock.c
+ *		To compile: cc -fPIC -shared -o nfslock.so nfslock.c -ldl
  *
  * Version:	@(#)nfslock.c  1.20  30-Nov-1998  miquels@cistron.nl
  *
@@ -15,9 +15,13 @@
 
 #include "autoconf.h"
 
+#include <dlfcn.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
 #include <sys/utsname.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -28,29 +32,106 @@
 #  error This is really only meant for Linux systems, sorry.
 #endif
 
-extern int __libc_open(const char *, int, ...);
+#ifndef NFS_SUPER_MAGIC
+#define NFS_SUPER_MAGIC	0x6969
+#endif
+
+#define FS_LOCAL	0	/* not NFS				*/
+#define FS_NFSEXCL	1	/* NFSv3 or later, O_EXCL is atomic	*/
+#define FS_NFS		2	/* NFSv2, O_EXCL must be emulated	*/
+
 static struct utsname uts;
+static unsigned int tmpcount;
+
+/*
+ *	The open() we stand in front of. glibc no longer exports
+ *	__libc_open, so ask the dynamic linker for the next one.
+ */
+static int libc_open(const char *file, int flags, mode_t mode)
+{
+	static int (*fn)(const char *, int, ...);
+
+	if (fn == NULL &&
+	    (fn = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT,
+			"open")) == NULL) {
+		errno = ENOSYS;
+		return -1;
+	}
+	return fn(file, flags, mode);
+}
+
+/*
+ *	Find the NFS version of the mount with device number "dev"
+ *	in /proc/self/mountinfo. Since NFSv3, the server does an
+ *	exclusive create atomically, so we don't have to.
+ */
+static int nfs_version(dev_t dev)
+{
+	FILE *fp;
+	char line[1024];
+	char *s;
+	unsigned int maj, min;
+	int vers = 0;
+
+	if ((fp = fopen("/proc/self/mountinfo", "r")) == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%*d %*d %u:%u", &maj, &min) != 2 ||
+		    makedev(maj, min) != dev)
+			continue;
+		if ((s = strstr(line, " - ")) == NULL)
+			continue;
+		s += 3;
+		if (strncmp(s, "nfs4 ", 5) == 0)
+			vers = 4;
+		else if (strncmp(s, "nfs ", 4) == 0)
+			vers = (s = strstr(s, "vers=")) ? atoi(s + 5) : 2;
+		break;
+	}
+	fclose(fp);
+	return vers;
+}
 
 /*
  *	See if the directory where is certain file is in
- *	is located on an NFS mounted volume.
+ *	is located on an NFS mounted volume, and if so, if
+ *	it does O_EXCL by itself. The answer is cached for
+ *	the last device we looked at.
  */
-static int is_nfs(const char *file)
+static int fs_type(const char *file)
 {
+	static dev_t lastdev;
+	static int lasttype = -1;
 	char dir[1024];
 	char *s;
 	struct stat st;
+	struct statfs sfs;
+	int type;
 
-	strncpy(dir, file, sizeof(dir));
+	strncpy(dir, file, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
 	if ((s = strrchr(dir, '/')) != NULL)
 		*s = 0;
 	else
 		strcpy(dir, ".");
 
 	if (stat(dir, &st) < 0)
-		return 0;
+		return FS_LOCAL;
+#ifdef NFSLOCK_TEST
+	/* the test build takes everything for NFSv2 */
+	return FS_NFS;
+#endif
+	if (lasttype >= 0 && st.st_dev == lastdev)
+		return lasttype;
 
-	return ((st.st_dev & 0xFF00) == 0);
+	if (statfs(dir, &sfs) < 0 || sfs.f_type != NFS_SUPER_MAGIC)
+		type = FS_LOCAL;
+	else
+		type = nfs_version(st.st_dev) >= 3 ? FS_NFSEXCL : FS_NFS;
+
+	lastdev = st.st_dev;
+	lasttype = type;
+	return type;
 }
 
 /*
@@ -125,26 +206,6 @@ static int istmplock(const char *file)
 	return 0;
 }
 
-/*
- *	Put our process ID into a string.
- */
-static void putpid(char *s)
-{
-	static char pidstr[6];
-	pid_t pid;
-	int i;
-
-	if (pidstr[0] == 0) {
-		pid = getpid();
-		for(i = 0; i < 5; i++) {
-			pidstr[4 - i] = (pid % 10) + '0';
-			pid /= 10;
-		}
-		pidstr[5] = 0;
-	}
-	strcpy(s, pidstr);
-}
-
 int open(const char *file, int flags, ...)
 {
 	char tmp[1024];
@@ -154,76 +215,79 @@ int open(const char *file, int flags, ...)
 	struct stat st1, st2;
 
 	if (!(flags & O_CREAT))
-		return __libc_open(file, flags);
+		return libc_open(file, flags, 0);
 
 	va_start(ap, flags);
 	mode = va_arg(ap, int);
 	va_end(ap);
 
 	/*
-	 *	NFS has no atomic creat-if-not-exist (O_EXCL) but we
+	 *	NFSv2 has no atomic creat-if-not-exist (O_EXCL) but we
 	 *	can emulate it by creating the file under a temporary
-	 *	name and then renaming it to the final destination.
+	 *	name and then linking it to the final destination.
 	 */
-	if ((flags & O_EXCL) && !istmplock(file) && is_nfs(file)) {
+	if ((flags & O_EXCL) && !istmplock(file) && fs_type(file) == FS_NFS) {
 		/*
-		 *	Try to make a unique temp name, network-wide.
+		 *	Make a unique temp name, network-wide: full
+		 *	hostname, pid, and a counter for multiple
+		 *	creates in the same process.
 		 */
-		if (strlen(file) > sizeof(tmp) - 16) {
-			errno = ENAMETOOLONG;
-			return -1;
-		}
+		if (uts.nodename[0] == 0) uname(&uts);
 		strcpy(tmp, file);
 		if ((s = strrchr(tmp, '/')) != NULL)
 			s++;
 		else
 			s = tmp;
-		*s = 0;
-		strcpy(s, ".nfs");
-		if (uts.nodename[0] == 0) uname(&uts);
-		for(i = 0; i < 5 && uts.nodename[i] &&
-			uts.nodename[i] != '.'; i++)
-				s[4 + i] = uts.nodename[i];
-		putpid(s + 4 + i);
-		if ((i = __libc_open(tmp, flags, mode)) < 0)
+		if (strlen(file) >= sizeof(tmp) ||
+		    snprintf(s, sizeof(tmp) - (s - tmp), ".nfs%s.%d.%x",
+				uts.nodename, (int)getpid(),
+				__sync_fetch_and_add(&tmpcount, 1)) >=
+				(int)(sizeof(tmp) - (s - tmp))) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		/*
+		 *	The temp name is ours alone, so it needs no O_EXCL,
+		 *	which would only fail if the reply to the create
+		 *	got lost and the retransmit found the file.
+		 */
+		if ((i = libc_open(tmp, (flags & ~O_EXCL) | O_TRUNC,
+				mode)) < 0)
 			return i;
 
 		/*
-		 *	We don't just check the result code from link()
-		 *	but we stat() both files as well to see if they're
-		 *	the same just to be sure.
+		 *	Don't trust the result code of link(), the reply
+		 *	might have been lost. If the link count of our
+		 *	open file went to 2, the link is there. fstat()
+		 *	on the fd we already have saves a lookup.
 		 */
 		error = link(tmp, file);
 		e = errno;
-		if (error < 0) {
-			(void)unlink(tmp);
-			close(i);
-			errno = e;
-			return error;
+		if (fstat(i, &st1) < 0) {
+			e = errno;
+			error = -1;
+		} else if (st1.st_nlink == 2) {
+			error = 0;
+		} else if (error == 0) {
+			/* cached link count? see if the name is ours. */
+			if (stat(file, &st2) < 0)
+				e = errno;
+			else if (st1.st_ino != st2.st_ino)
+				e = EEXIST;
+			else
+				e = 0;
+			error = e ? -1 : 0;
 		}
-
-		error = stat(tmp, &st1);
-		e = errno;
 		(void)unlink(tmp);
 		if (error < 0) {
 			close(i);
 			errno = e;
 			return -1;
 		}
-		if (stat(file, &st2) < 0) {
-			close(i);
-			errno = e;
-			return -1;
-		}
-		if (st1.st_ino != st2.st_ino) {
-			close(i);
-			errno = EEXIST;
-			return -1;
-		}
 
 		return i;
 	}
-	return __libc_open(file, flags, mode);
+	return libc_open(file, flags, mode);
 }
 
 int creat(const char *file, mode_t mode)
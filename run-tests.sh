@@ -56,5 +56,86 @@ time_elapsed=`expr $time_end - $time_start`
 [ "$time_elapsed" = '8' ] || { echo "lockfile should take 8 seconds to be replaced. [$time_elapsed]"; exit 1; }
 [ ! -f testlock.lock ] || { echo "lockfile still exists after running cmd"; exit 1; }
 
+# in exec mode the command holds the lock, and it is stale when it exits
+dotlockfile -l -E testlock.lock sh -c '! dotlockfile -l -r 0 testlock.lock' ||
+	{ echo "lock not held by exec'd command"; exit 1; }
+dotlockfile -l -r 0 testlock.lock ||
+	{ echo "lock not stale after exec'd command exited"; exit 1; }
+dotlockfile -u testlock.lock
+
+# a timeout should end the wait early, with L_TIMEOUT
+dotlockfile -l -r 0 testlock.lock
+rc=0
+dotlockfile -l --timeout 500 testlock.lock || rc=$?
+[ "$rc" = 9 ] || { echo "--timeout should return 9 [$rc]"; exit 1; }
+dotlockfile -u testlock.lock
+
+# -g removes orphaned temp files: of dead local processes,
+# and old ones of other hosts
+rm -rf testgc.d && mkdir testgc.d
+h=$(hostname | sed 's/\..*//')
+tmpname() {
+	n=$(printf %05d $1)
+	printf ".lk%s0%.$((31 - 3 - ${#n} - 1))s" $n "$2"
+}
+dead=$(sh -c 'echo $$')
+touch -t 200001010000 "testgc.d/$(tmpname $dead $h)" \
+	"testgc.d/$(tmpname 12345 otherhost)"
+touch "testgc.d/$(tmpname 12346 otherhost)"
+# a hostname that is cut off can't be told from another host's
+if [ ${#h} -le 21 ]; then
+	touch -t 200001010000 "testgc.d/$(tmpname $$ $h)"
+else
+	touch "testgc.d/$(tmpname $$ $h)"
+fi
+dotlockfile -g testgc.d
+[ -f "testgc.d/$(tmpname $$ $h)" ] && [ -f "testgc.d/$(tmpname 12346 otherhost)" ] &&
+	[ "$(ls -A testgc.d | wc -l)" -eq 2 ] ||
+	{ echo "dotlockfile -g removed the wrong files:" $(ls -A testgc.d); exit 1; }
+rm -rf testgc.d
+
+# an abstract lock (-S) is held while the command runs, and leaves no file
+dotlockfile -S testlock.lock sh -c \
+	'! dotlockfile -r 0 -S testlock.lock true && dotlockfile -c -S testlock.lock' ||
+	{ echo "abstract lock not held while running cmd"; exit 1; }
+! dotlockfile -c -S testlock.lock ||
+	{ echo "abstract lock still held after cmd"; exit 1; }
+[ ! -e testlock.lock ] || { echo "abstract lock created a file"; exit 1; }
+# and a relative name is the same lock as the absolute one
+dotlockfile -S testlock.lock sh -c \
+	'! dotlockfile -r 0 -S "$PWD/testlock.lock" true' ||
+	{ echo "abstract lock depends on the working directory"; exit 1; }
+
+# threads of one process queue in memory (L_THREAD)
+locktest thread testlock.lock || { echo "L_THREAD tests failed"; exit 1; }
+
+# the sharded namespace
+rm -rf testns.d && mkdir testns.d
+locktest ns testns.d || { echo "lockfile_ns tests failed"; exit 1; }
+rm -rf testns.d
+
+# durability levels
+locktest durable testlock.lock || { echo "durability tests failed"; exit 1; }
+
+# maillock2() with ML_FCNTL
+locktest maillock testmbox || { echo "ML_FCNTL tests failed"; exit 1; }
+
+# L_HOLDFD without -E: the lock is alive as long as the descriptor
+locktest holdfd testlock.lock || { echo "L_HOLDFD tests failed"; exit 1; }
+
+# a reused pid, and one of another pid namespace
+locktest pidreuse testlock.lock || { echo "pid reuse tests failed"; exit 1; }
+
+# a handle that keeps its temp file (L_KEEPTMP), and cleans it up
+locktest keeptmp testlock.lock || { echo "L_KEEPTMP tests failed"; exit 1; }
+
+# the O_EXCL emulation of nfslock.so, with every create looking
+# lost to the real open() and some link() replies lost as well
+if [ -f nfslocktest.so ] && [ -f nfsfault.so ]; then
+	NFSFAULT=seed=1,lostopen=100,lost=20 \
+	LD_PRELOAD="./nfslocktest.so ./nfsfault.so" locktest excl testexcl ||
+		{ echo "nfslock tests failed"; exit 1; }
+fi
+
 echo "tests OK"
 
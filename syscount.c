@@ -0,0 +1,297 @@
+/*
+ * syscount.c	Count the system calls that lockfile_create(),
+ *		lockfile_check(), lockfile_remove(), maillock() and
+ *		mailunlock() make when the lock is not contended, and
+ *		compare them with the budget in the file "syscall-budget".
+ *
+ *		A child process runs the calls under ptrace(); every call
+ *		is bracketed by a getpgid() with a magic argument, which
+ *		the library itself never makes, so the tracer knows what
+ *		to count. Each call is made twice and the second one is
+ *		counted, so one-time setup (malloc arena, cached hostname)
+ *		doesn't get in the way.
+ *
+ *		lockfile_create() with L_PID includes 3 calls (open, read,
+ *		close of /proc/PID/stat) for the start time of the process,
+ *		which goes into the lockfile so that lockfile_check() can
+ *		tell a reused pid. That can't be read later, when a checker
+ *		needs it: by then the pid may belong to someone else. They
+ *		are local calls, not NFS round trips.
+ *
+ *		Copyright (C) Miquel van Smoorenburg and contributors 1999-2021
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version 2
+ *		of the License, or (at your option) any later version.
+ */
+
+#include "autoconf.h"
+
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <lockfile.h>
+#include <maillock.h>
+
+#define MARK_BEGIN	0x7fff0000
+#define MARK_END	0x7fff1000
+#define MAXNR		1024
+#define SKIP		77
+
+static const char *ops[] = {
+	"lockfile_create",
+	"lockfile_check",
+	"lockfile_remove",
+	"maillock",
+	"mailunlock",
+};
+#define NOPS	(int)(sizeof(ops) / sizeof(ops[0]))
+
+static struct {
+	int		nr;
+	const char	*name;
+} names[] = {
+#ifdef SYS_open
+	{ SYS_open,		"open" },
+#endif
+#ifdef SYS_stat
+	{ SYS_stat,		"stat" },
+#endif
+#ifdef SYS_lstat
+	{ SYS_lstat,		"lstat" },
+#endif
+#ifdef SYS_link
+	{ SYS_link,		"link" },
+#endif
+#ifdef SYS_unlink
+	{ SYS_unlink,		"unlink" },
+#endif
+#ifdef SYS_time
+	{ SYS_time,		"time" },
+#endif
+	{ SYS_openat,		"openat" },
+	{ SYS_read,		"read" },
+#ifdef SYS_pread64
+	{ SYS_pread64,		"pread64" },
+#endif
+	{ SYS_write,		"write" },
+	{ SYS_close,		"close" },
+#ifdef SYS_fstat
+	{ SYS_fstat,		"fstat" },
+#endif
+#ifdef SYS_newfstatat
+	{ SYS_newfstatat,	"newfstatat" },
+#endif
+	{ SYS_statx,		"statx" },
+	{ SYS_linkat,		"linkat" },
+	{ SYS_unlinkat,		"unlinkat" },
+	{ SYS_uname,		"uname" },
+	{ SYS_getpid,		"getpid" },
+	{ SYS_getppid,		"getppid" },
+	{ SYS_kill,		"kill" },
+	{ SYS_flock,		"flock" },
+	{ SYS_fcntl,		"fcntl" },
+	{ SYS_fstatfs,		"fstatfs" },
+	{ SYS_brk,		"brk" },
+	{ SYS_mmap,		"mmap" },
+	{ SYS_munmap,		"munmap" },
+	{ SYS_clock_gettime,	"clock_gettime" },
+	{ SYS_utimensat,	"utimensat" },
+};
+
+static int	count[NOPS];
+static int	bynr[NOPS][MAXNR];
+
+static const char *sysname(int nr)
+{
+	static char	buf[16];
+	unsigned int	i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if (names[i].nr == nr)
+			return names[i].name;
+	snprintf(buf, sizeof(buf), "#%d", nr);
+	return buf;
+}
+
+static void mark(long m)
+{
+	syscall(SYS_getpgid, m);
+}
+
+/*
+ *	The traced child.
+ */
+static void run(const char *dir)
+{
+	char	lock[1024], mail[1024];
+	int	i, op;
+
+	snprintf(lock, sizeof(lock), "%s/count.lock", dir);
+	snprintf(mail, sizeof(mail), "%s/countuser", dir);
+	setenv("MAIL", mail, 1);
+
+	if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+		_exit(SKIP);
+	raise(SIGSTOP);
+
+	for (i = 0; i < 2; i++) {
+		for (op = 0; op < NOPS; op++) {
+			mark(i ? MARK_BEGIN + op : 0);
+			switch (op) {
+			case 0:
+				if (lockfile_create(lock, 0, L_PID) != 0)
+					_exit(1);
+				break;
+			case 1:
+				if (lockfile_check(lock, L_PID) != 0)
+					_exit(1);
+				break;
+			case 2:
+				if (lockfile_remove(lock) != 0)
+					_exit(1);
+				break;
+			case 3:
+				if (maillock("countuser", 0) != 0)
+					_exit(1);
+				break;
+			case 4:
+				mailunlock();
+				break;
+			}
+			mark(i ? MARK_END + op : 0);
+		}
+	}
+	_exit(0);
+}
+
+/*
+ *	Read "name count" lines, compare with what we counted.
+ */
+static int compare(const char *budgetfile)
+{
+	FILE	*fp;
+	char	line[256], name[64];
+	int	max, op, n, failed = 0, seen[NOPS] = { 0 };
+
+	if ((fp = fopen(budgetfile, "r")) == NULL) {
+		perror(budgetfile);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || sscanf(line, "%63s %d", name, &max) != 2)
+			continue;
+		for (op = 0; op < NOPS; op++)
+			if (strcmp(ops[op], name) == 0)
+				break;
+		if (op == NOPS) {
+			fprintf(stderr, "%s: unknown call %s\n", budgetfile, name);
+			failed = 1;
+			continue;
+		}
+		seen[op] = 1;
+		printf("%-16s %3d syscalls, budget %3d%s\n", name, count[op],
+			max, count[op] > max ? "  OVER BUDGET" : "");
+		if (count[op] <= max)
+			continue;
+		failed = 1;
+		for (n = 0; n < MAXNR; n++)
+			if (bynr[op][n])
+				printf("\t%-16s %d\n", sysname(n), bynr[op][n]);
+	}
+	fclose(fp);
+	for (op = 0; op < NOPS; op++) {
+		if (!seen[op]) {
+			fprintf(stderr, "%s: no budget for %s\n", budgetfile, ops[op]);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	struct ptrace_syscall_info	info;
+	char		tmpdir[] = "/tmp/syscountXXXXXX";
+	const char	*budgetfile = argc > 1 ? argv[1] : "syscall-budget";
+	pid_t		pid;
+	long		arg;
+	int		status, sig = 0, op = -1, r;
+
+	if (mkdtemp(tmpdir) == NULL) {
+		perror("syscount: mkdtemp");
+		return 1;
+	}
+	if ((pid = fork()) < 0) {
+		perror("syscount: fork");
+		return 1;
+	}
+	if (pid == 0)
+		run(tmpdir);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+		rmdir(tmpdir);
+		if (WIFEXITED(status) && WEXITSTATUS(status) == SKIP) {
+			printf("syscount: ptrace not permitted, skipped\n");
+			return 0;
+		}
+		fprintf(stderr, "syscount: child did not stop\n");
+		return 1;
+	}
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+		PTRACE_O_TRACESYSGOOD|PTRACE_O_EXITKILL);
+
+	for (;;) {
+		if (ptrace(PTRACE_SYSCALL, pid, NULL, sig) < 0)
+			break;
+		sig = 0;
+		if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+			break;
+		if (WSTOPSIG(status) != (SIGTRAP|0x80)) {
+			sig = WSTOPSIG(status);
+			continue;
+		}
+		r = ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info);
+		if (r < 0 && errno == EIO) {
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			rmdir(tmpdir);
+			printf("syscount: no PTRACE_GET_SYSCALL_INFO, skipped\n");
+			return 0;
+		}
+		if (r <= 0 || info.op != PTRACE_SYSCALL_INFO_ENTRY)
+			continue;
+		arg = (long)info.entry.args[0];
+		if (info.entry.nr == SYS_getpgid &&
+		    arg >= MARK_BEGIN && arg < MARK_BEGIN + NOPS) {
+			op = arg - MARK_BEGIN;
+			continue;
+		}
+		if (info.entry.nr == SYS_getpgid &&
+		    (arg == 0 || (arg >= MARK_END && arg < MARK_END + NOPS))) {
+			op = -1;
+			continue;
+		}
+		if (op >= 0) {
+			count[op]++;
+			if (info.entry.nr < MAXNR)
+				bynr[op][info.entry.nr]++;
+		}
+	}
+	rmdir(tmpdir);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "syscount: lock calls failed in the child\n");
+		return 1;
+	}
+	return compare(budgetfile);
+}
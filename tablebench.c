@@ -0,0 +1,307 @@
+/*
+ * tablebench.c	Compare lock tables with dotfiles, for lockfiles in one
+ *		directory, for the sharded namespace and for a lock table
+ *		file. In the "hold" run a number of processes each take a
+ *		range of lock names, hold all of them at the same time and
+ *		then release them again. In the "cycle" run they lock and
+ *		unlock random names, so only a few are held at any time.
+ *		With -D, the cost of each durability level of a plain
+ *		lockfile is measured instead, one process, no contention;
+ *		use -d to point it at the filesystem of interest.
+ *
+ *		Copyright (C) Miquel van Smoorenburg and contributors 1999-2021
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version 2
+ *		of the License, or (at your option) any later version.
+ */
+
+#include "autoconf.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#define LOCKFILE_EXPERIMENTAL
+#include <lockfile.h>
+
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
+#define DOTFILE		0
+#define NS		1
+#define TABLE		2
+
+static const char *backends[] = { "dotfile", "ns", "table" };
+
+static const struct {
+	const char	*name;
+	int		flags;
+} levels[] = {
+	{ "none",	L_DURABLE_NONE },
+	{ "default",	L_PID },
+	{ "content",	L_PID|L_DURABLE_CONTENT },
+	{ "full",	L_PID|L_DURABLE_FULL },
+};
+
+static char	dir[256];
+static char	table[300];
+static long	*failed;
+static int	cycles = 20000;
+
+static long now_us(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int take(int how, int n)
+{
+	char	name[300];
+
+	switch (how) {
+	case DOTFILE:
+		snprintf(name, sizeof(name), "%s/lock%d.lock", dir, n);
+		return lockfile_create(name, 0, L_PID);
+	case NS:
+		snprintf(name, sizeof(name), "lock%d", n);
+		return lockfile_ns_create(dir, name, 0, L_PID);
+	default:
+		snprintf(name, sizeof(name), "lock%d", n);
+		return lockfile_table_create(table, name, 0, L_PID);
+	}
+}
+
+static int give(int how, int n)
+{
+	char	name[300];
+
+	switch (how) {
+	case DOTFILE:
+		snprintf(name, sizeof(name), "%s/lock%d.lock", dir, n);
+		return lockfile_remove(name);
+	case NS:
+		snprintf(name, sizeof(name), "lock%d", n);
+		return lockfile_ns_remove(dir, name);
+	default:
+		snprintf(name, sizeof(name), "lock%d", n);
+		return lockfile_table_remove(table, name);
+	}
+}
+
+/*
+ *	One process: take names [lo, hi), then let them go. The pipe
+ *	tells the parent when we hold them all, and the parent tells
+ *	us when everybody does.
+ */
+static void worker(int how, int lo, int hi, int ready, int go)
+{
+	char	c = 0;
+	int	i;
+
+	for (i = lo; i < hi; i++)
+		if (take(how, i) != L_SUCCESS)
+			__atomic_add_fetch(failed, 1, __ATOMIC_RELAXED);
+	(void)!write(ready, &c, 1);
+	(void)!read(go, &c, 1);
+	for (i = lo; i < hi; i++)
+		give(how, i);
+	_exit(0);
+}
+
+/*
+ *	One process: lock and unlock random names.
+ */
+static void cycler(int how, int names, unsigned int seed)
+{
+	int	i, n;
+
+	for (i = 0; i < cycles; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		n = seed % names;
+		/* somebody else has it: that's not a failure here */
+		if (take(how, n) == L_SUCCESS)
+			give(how, n);
+	}
+	_exit(0);
+}
+
+static int cycle(int how, int names, int procs)
+{
+	long	t;
+	int	i;
+
+	t = now_us();
+	for (i = 0; i < procs; i++) {
+		switch (fork()) {
+		case -1:
+			perror("tablebench: fork");
+			return 1;
+		case 0:
+			cycler(how, names, 2654435761u * (i + 1));
+		}
+	}
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	t = now_us() - t;
+
+	printf("%-8s cycle %8d %6.2fs %8.0f/s\n", backends[how],
+		procs * cycles, t / 1e6, procs * cycles / (t / 1e6));
+	return 0;
+}
+
+static int hold(int how, int names, int procs)
+{
+	long	t0, t1, t2;
+	int	ready[2], go[2];
+	int	i;
+	char	c;
+
+	if (pipe(ready) < 0 || pipe(go) < 0) {
+		perror("tablebench: pipe");
+		return 1;
+	}
+	*failed = 0;
+	t0 = now_us();
+	for (i = 0; i < procs; i++) {
+		switch (fork()) {
+		case -1:
+			perror("tablebench: fork");
+			return 1;
+		case 0:
+			close(ready[0]);
+			close(go[1]);
+			worker(how, (long)names * i / procs,
+				(long)names * (i + 1) / procs, ready[1], go[0]);
+		}
+	}
+	close(ready[1]);
+	close(go[0]);
+	for (i = 0; i < procs; i++)
+		(void)!read(ready[0], &c, 1);
+	t1 = now_us();
+	close(go[1]);
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+	t2 = now_us();
+	close(ready[0]);
+
+	printf("%-8s hold  %8d %6.2fs %8.0f/s, release %6.2fs %8.0f/s, "
+		"failed %ld\n", backends[how], names,
+		(t1 - t0) / 1e6, names / ((t1 - t0) / 1e6),
+		(t2 - t1) / 1e6, names / ((t2 - t1) / 1e6), *failed);
+	return 0;
+}
+
+/*
+ *	Create and remove one lockfile, over and over, at every level.
+ */
+static int durability(void)
+{
+	char	name[300];
+	long	t;
+	int	i, l;
+
+	snprintf(name, sizeof(name), "%s/durable.lock", dir);
+	for (l = 0; l < (int)(sizeof(levels) / sizeof(levels[0])); l++) {
+		t = now_us();
+		for (i = 0; i < cycles; i++) {
+			if (lockfile_create2(name, 0, levels[l].flags,
+					NULL, 0) != L_SUCCESS ||
+			    lockfile_remove(name) < 0) {
+				perror("tablebench: lockfile_create2");
+				return 1;
+			}
+		}
+		t = now_us() - t;
+		printf("%-8s %8d %6.2fs %8.0f/s %8.1fus\n", levels[l].name,
+			cycles, t / 1e6, cycles / (t / 1e6),
+			(double)t / cycles);
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: tablebench [-n names] [-c cycles] [-p procs] [-d dir] [-D]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char	cmd[300];
+	char	*d = NULL;
+	int	names = 10000;
+	int	procs = 4;
+	int	dur = 0;
+	int	c, how;
+
+	while ((c = getopt(argc, argv, "n:c:p:d:D")) != EOF) switch(c) {
+		case 'n':
+			names = atoi(optarg);
+			break;
+		case 'c':
+			cycles = atoi(optarg);
+			break;
+		case 'p':
+			procs = atoi(optarg);
+			break;
+		case 'd':
+			d = optarg;
+			break;
+		case 'D':
+			dur = 1;
+			break;
+		default:
+			usage();
+	}
+	if (names < 1 || cycles < 1 || procs < 1)
+		usage();
+
+	failed = mmap(NULL, sizeof(*failed), PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (failed == MAP_FAILED) {
+		perror("tablebench: mmap");
+		return 1;
+	}
+
+	for (how = DOTFILE; how <= TABLE; how++) {
+		snprintf(dir, sizeof(dir), "%s/tablebenchXXXXXX",
+			d ? d : "/tmp");
+		if (mkdtemp(dir) == NULL) {
+			perror("tablebench: mkdtemp");
+			return 1;
+		}
+		if (dur) {
+			c = durability();
+			snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+			(void)!system(cmd);
+			return c;
+		}
+		snprintf(table, sizeof(table), "%s/bench.table", dir);
+		/* one bucket (8 entries) per name, so none fills up */
+		if (how == TABLE && lockfile_table_init(table, names) != 0) {
+			perror("tablebench: lockfile_table_init");
+			return 1;
+		}
+		c = hold(how, names, procs);
+		if (c == 0)
+			c = cycle(how, names, procs);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		(void)!system(cmd);
+		if (c)
+			return c;
+	}
+	return 0;
+}